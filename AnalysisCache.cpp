@@ -0,0 +1,294 @@
+#include "AnalysisCache.hpp"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+#include <iterator>
+
+namespace NesCheck {
+
+// bump whenever the analyses or the format of the entries change, so that old entries are ignored
+static const char CacheFormat[] = "nescheck-cache 3";
+
+
+static void describeConstant(raw_ostream &OS, const Constant *C);
+
+static void describeOperand(raw_ostream &OS, const Value *V, const DenseMap<const Value*, unsigned> &Locals) {
+    auto local = Locals.find(V);
+    if (local != Locals.end()) {
+        OS << (isa<Argument>(V) ? "a" : isa<BasicBlock>(V) ? "b" : "i") << local->second;
+    } else if (const GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+        OS << "@" << GV->getName() << (GV->isDeclaration() ? " decl " : " def ") << *GV->getType();
+    } else if (const Constant *C = dyn_cast<Constant>(V)) {
+        describeConstant(OS, C);
+    } else if (const InlineAsm *IA = dyn_cast<InlineAsm>(V)) {
+        OS << "asm " << IA->getAsmString();
+    } else {
+        OS << "m"; // metadata (debug info) does not affect the analyses
+    }
+}
+
+static void describeConstant(raw_ostream &OS, const Constant *C) {
+    static const DenseMap<const Value*, unsigned> NoLocals;
+    OS << "(" << *C->getType() << " ";
+    if (const GlobalValue *GV = dyn_cast<GlobalValue>(C)) {
+        describeOperand(OS, GV, NoLocals);
+    } else if (const ConstantInt *CI = dyn_cast<ConstantInt>(C)) {
+        OS << CI->getValue();
+    } else if (const ConstantFP *CFP = dyn_cast<ConstantFP>(C)) {
+        OS << CFP->getValueAPF().bitcastToAPInt();
+    } else if (const ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
+        OS << "data";
+        for (unsigned char c : CDS->getRawDataValues()) OS << " " << (unsigned)c;
+    } else {
+        const ConstantExpr *CE = dyn_cast<ConstantExpr>(C);
+        OS << (CE ? CE->getOpcodeName() : "k") << C->getValueID();
+        if (CE && CE->isCompare()) OS << " " << CE->getPredicate();
+        for (const Use &Op : C->operands()) {
+            OS << " ";
+            describeConstant(OS, cast<Constant>(Op.get()));
+        }
+    }
+    OS << ")";
+}
+
+void AnalysisCache::HashFunction(const Function &F, SmallString<32> &Hash) {
+    DenseMap<const Value*, unsigned> Locals;
+    for (const Argument &A : F.args()) Locals[&A] = A.getArgNo();
+    unsigned n = 0;
+    for (const BasicBlock &BB : F) Locals[&BB] = n++;
+    n = 0;
+    for (const_inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i) Locals[&*i] = n++;
+
+    std::string Description;
+    raw_string_ostream OS(Description);
+    OS << CacheFormat << "\n" << *F.getFunctionType() << "\n";
+    for (const BasicBlock &BB : F) {
+        OS << "block\n";
+        for (const Instruction &I : BB) {
+            OS << I.getOpcodeName() << " " << *I.getType();
+            if (const CmpInst *CI = dyn_cast<CmpInst>(&I)) OS << " " << CI->getPredicate();
+            for (const Use &Op : I.operands()) {
+                OS << ", ";
+                describeOperand(OS, Op.get(), Locals);
+            }
+            OS << "\n";
+        }
+    }
+
+    MD5 Hasher;
+    Hasher.update(OS.str());
+    MD5::MD5Result Result;
+    Hasher.final(Result);
+    MD5::stringifyResult(Result, Hash);
+}
+
+std::string AnalysisCache::GetPath(StringRef Hash) const {
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, Hash + ".nescheck");
+    return Path.str().str();
+}
+
+
+// The values of a summary are written as:
+//   aN   - the N-th argument of the function
+//   iN   - the N-th instruction of the function (in inst_iterator order)
+//   oN.K - the K-th operand of the N-th instruction (a global, a constant, ...)
+//   pN.K - the K-th parameter of the function called by the N-th instruction
+// and the return values as "r" for the function itself and "RN" for the callee of the N-th instruction.
+namespace {
+struct ValueNumbering {
+    const Function &F;
+    std::vector<const Instruction*> Instructions;
+    DenseMap<const Value*, std::string> Names;
+    DenseMap<const Function*, std::string> ReturnNames;
+
+    ValueNumbering(const Function &F) : F(F) {
+        for (const_inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i)
+            Instructions.push_back(&*i);
+    }
+
+    void nameValues() {
+        for (const Argument &A : F.args()) Names[&A] = "a" + std::to_string(A.getArgNo());
+        for (unsigned n = 0; n < Instructions.size(); n++) Names[Instructions[n]] = "i" + std::to_string(n);
+        for (unsigned n = 0; n < Instructions.size(); n++) {
+            const Instruction *I = Instructions[n];
+            for (unsigned k = 0; k < I->getNumOperands(); k++)
+                Names.insert(std::make_pair(I->getOperand(k), "o" + std::to_string(n) + "." + std::to_string(k)));
+            const CallInst *CI = dyn_cast<CallInst>(I);
+            const Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+            if (!Callee || Callee == &F) continue;
+            ReturnNames.insert(std::make_pair(Callee, "R" + std::to_string(n)));
+            for (const Argument &A : Callee->args())
+                Names.insert(std::make_pair(&A, "p" + std::to_string(n) + "." + std::to_string(A.getArgNo())));
+        }
+    }
+
+    // empty if the endpoint cannot be written relative to F
+    std::string getName(const ConstraintShard::Endpoint &E) const {
+        if (E.ReturnOf == &F) return "r";
+        if (E.ReturnOf) {
+            auto entry = ReturnNames.find(E.ReturnOf);
+            return entry != ReturnNames.end() ? entry->second : "";
+        }
+        auto entry = Names.find(E.V);
+        return entry != Names.end() ? entry->second : "";
+    }
+
+    const CallInst *getCall(unsigned n) const {
+        return n < Instructions.size() ? dyn_cast<CallInst>(Instructions[n]) : nullptr;
+    }
+
+    // returns false if the name does not refer to a value of F
+    bool getEndpoint(StringRef Name, ConstraintShard::Endpoint &E) const {
+        E.V = nullptr;
+        E.ReturnOf = nullptr;
+        if (Name == "r") {
+            E.ReturnOf = &F;
+            return true;
+        }
+        if (Name.empty()) return false;
+        char kind = Name[0];
+        std::pair<StringRef, StringRef> Numbers = Name.drop_front().split('.');
+        unsigned n, k = 0;
+        if (Numbers.first.getAsInteger(10, n) || (!Numbers.second.empty() && Numbers.second.getAsInteger(10, k)))
+            return false;
+
+        if (kind == 'a') {
+            if (n >= F.arg_size()) return false;
+            E.V = &*std::next(F.arg_begin(), n);
+        } else if (kind == 'i') {
+            if (n >= Instructions.size()) return false;
+            E.V = Instructions[n];
+        } else if (kind == 'o') {
+            if (n >= Instructions.size() || k >= Instructions[n]->getNumOperands()) return false;
+            E.V = Instructions[n]->getOperand(k);
+        } else if (kind == 'p' || kind == 'R') {
+            const CallInst *CI = getCall(n);
+            const Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+            if (!Callee) return false;
+            if (kind == 'R') {
+                E.ReturnOf = Callee;
+            } else {
+                if (k >= Callee->arg_size()) return false;
+                E.V = &*std::next(Callee->arg_begin(), k);
+            }
+        } else {
+            return false;
+        }
+        return true;
+    }
+};
+}
+
+bool AnalysisCache::Load(const Function &F, StringRef Hash, FunctionSummary &Summary) const {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(GetPath(Hash));
+    if (Buffer.getError()) return false;
+
+    ValueNumbering Numbering(F);
+    FunctionSummary Loaded;
+    line_iterator L(**Buffer);
+    if (L.is_at_eof() || *L != CacheFormat) return false;
+    for (++L; !L.is_at_eof(); ++L) {
+        SmallVector<StringRef, 8> Fields;
+        L->split(Fields, " ", -1, false);
+        if (Fields.empty()) {
+            return false;
+        } else if (Fields[0] == "flow" && Fields.size() == 3) {
+            ConstraintShard::Flow Flow;
+            if (!Numbering.getEndpoint(Fields[1], Flow.From) || !Numbering.getEndpoint(Fields[2], Flow.To))
+                return false;
+            Loaded.Constraints.Flows.push_back(Flow);
+        } else if (Fields[0] == "bound" && Fields.size() == 3) {
+            ConstraintShard::Endpoint E;
+            int ptrType;
+            if (!Numbering.getEndpoint(Fields[1], E) || E.ReturnOf || Fields[2].getAsInteger(10, ptrType)
+                    || ptrType < (int)VariableStates::Safe || ptrType > (int)VariableStates::Dyn)
+                return false;
+            Loaded.Constraints.LowerBounds.push_back(std::make_pair(E.V, (VariableStates)ptrType));
+        } else if (Fields[0] == "param" && Fields.size() >= 2) {
+            ParamSizeSummary Param;
+            Param.Local = Fields[1] == "1";
+            for (unsigned f = 2; f < Fields.size(); f++) {
+                if (Fields[f].startswith("i")) {
+                    unsigned n;
+                    if (Fields[f].drop_front().getAsInteger(10, n) || n >= Numbering.Instructions.size())
+                        return false;
+                    Param.SafeUses.push_back(Numbering.Instructions[n]);
+                    continue;
+                }
+                std::pair<StringRef, StringRef> Dep = Fields[f].split('.');
+                unsigned n, i;
+                if (Dep.first.getAsInteger(10, n) || Dep.second.getAsInteger(10, i) || !Numbering.getCall(n))
+                    return false;
+                Param.Dependencies.push_back(std::make_pair(Numbering.getCall(n), i));
+            }
+            Loaded.Params.push_back(Param);
+        } else {
+            return false;
+        }
+    }
+    if (Loaded.Params.size() != F.arg_size()) return false;
+
+    Summary = std::move(Loaded);
+    return true;
+}
+
+bool AnalysisCache::Store(const Function &F, StringRef Hash, const FunctionSummary &Summary) const {
+    ValueNumbering Numbering(F);
+    Numbering.nameValues();
+    DenseMap<const Value*, unsigned> InstructionNumbers;
+    for (unsigned n = 0; n < Numbering.Instructions.size(); n++) InstructionNumbers[Numbering.Instructions[n]] = n;
+
+    std::string Entry;
+    raw_string_ostream OS(Entry);
+    OS << CacheFormat << "\n";
+    for (const ConstraintShard::Flow &Flow : Summary.Constraints.Flows) {
+        std::string From = Numbering.getName(Flow.From), To = Numbering.getName(Flow.To);
+        if (From.empty() || To.empty()) return false;
+        OS << "flow " << From << " " << To << "\n";
+    }
+    for (auto &bound : Summary.Constraints.LowerBounds) {
+        std::string Name = Numbering.getName({ bound.first, nullptr });
+        if (Name.empty()) return false;
+        OS << "bound " << Name << " " << (int)bound.second << "\n";
+    }
+    for (const ParamSizeSummary &Param : Summary.Params) {
+        OS << "param " << (Param.Local ? 1 : 0);
+        for (auto &dep : Param.Dependencies)
+            OS << " " << InstructionNumbers.lookup(dep.first) << "." << dep.second;
+        for (const Instruction *I : Param.SafeUses)
+            OS << " i" << InstructionNumbers.lookup(I);
+        OS << "\n";
+    }
+
+    // write to a temporary file first, so that concurrent builds never read a partial entry
+    if (sys::fs::create_directories(Dir)) return false;
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(GetPath(Hash) + "-%%%%%%.tmp", FD, TempPath)) return false;
+    {
+        raw_fd_ostream Out(FD, /*shouldClose=*/true);
+        Out << OS.str();
+        if (Out.has_error()) {
+            Out.clear_error();
+            sys::fs::remove(TempPath);
+            return false;
+        }
+    }
+    if (sys::fs::rename(TempPath, GetPath(Hash))) {
+        sys::fs::remove(TempPath);
+        return false;
+    }
+    return true;
+}
+
+}
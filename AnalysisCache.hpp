@@ -0,0 +1,57 @@
+#pragma once
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include <string>
+#include <vector>
+
+#include "ClassificationSolver.hpp"
+
+
+using namespace llvm;
+
+namespace NesCheck {
+
+	// Whether the size of a parameter is used by its function: always if Local, otherwise only if one of
+	// the callees uses the size of the parameter that it is passed to (call, operand number), or if one
+	// of the GEPs and casts of the parameter in SafeUses is not SAFE or is applied to a pointer that is not
+	// (the classification is only known once the whole module is solved)
+	struct ParamSizeSummary {
+		bool Local = false;
+		std::vector<std::pair<const CallInst*, unsigned>> Dependencies;
+		std::vector<const Instruction*> SafeUses;
+	};
+
+	// Everything the whole-module analyses need to know about one function. It only depends on the IR
+	// of the function itself (and on the names and types of what it refers to), so it can be cached.
+	struct FunctionSummary {
+		ConstraintShard Constraints;
+		std::vector<ParamSizeSummary> Params; // indexed by argument number
+	};
+
+	// On-disk cache of the FunctionSummary of every function, one file per structural hash in the
+	// -nescheck-cache-dir directory, so that incremental builds only re-analyze the functions that
+	// changed. The values are stored relative to the function (the i-th instruction, the j-th operand of
+	// the i-th instruction, ...), so a summary can be loaded back into any function with the same hash.
+	class AnalysisCache {
+	public:
+		AnalysisCache(StringRef dir) : Dir(dir) {}
+
+		// the hash covers the instructions, their types and operands, and the names, types and
+		// linkage of the globals and functions that the function refers to
+		static void HashFunction(const Function &F, SmallString<32> &Hash);
+
+		// returns false if there is no (valid) entry for Hash
+		bool Load(const Function &F, StringRef Hash, FunctionSummary &Summary) const;
+		// returns false if the summary refers to values that cannot be stored relative to F
+		bool Store(const Function &F, StringRef Hash, const FunctionSummary &Summary) const;
+
+	private:
+		std::string Dir;
+
+		std::string GetPath(StringRef Hash) const;
+	};
+
+}
@@ -1,79 +1,95 @@
 #include "AnalysisState.hpp"
+#include "ClassificationSolver.hpp"
 
 namespace NesCheck {
 
-int _safeptrscount, _seqptrscount, _dynptrscount, _hasmetadatatableentrycount;
-llvm::Type* sizetype;
-
-AnalysisState::AnalysisState() {}
+AnalysisState::AnalysisState() {
+    NullPointerInfo = VariableInfo();
+    NullPointerInfo.classification = VariableStates::Safe;
+}
 
 void AnalysisState::SetSizeType(llvm::Type* st) {
     sizetype = st;
+    NullPointerInfo.size = llvm::ConstantInt::get(sizetype, 0);
+}
+
+void AnalysisState::SetClassificationSolver(const ClassificationSolver *solver) {
+    Solver = solver;
 }
 
 void AnalysisState::RegisterFunction(Function* func) {
     numFunctions++;
+    SizedInCurrentFunction.clear();
 }
 
-void AnalysisState::RegisterVariable(const VariableMapKeyType *Decl) {
-    if (Variables.count(Decl)) return;
+VariableInfo & AnalysisState::LookupOrRegisterVariable(const VariableMapKeyType *Decl) {
+    auto inserted = Variables.insert(std::make_pair(Decl, (VariableInfo*)nullptr));
+    if (!inserted.second) return *(inserted.first->second);
+
+    VariablesStorage.push_back(VariableInfo());
+    VariableInfo& info = VariablesStorage.back();
+    inserted.first->second = &info;
+    info.classification = Solver ? Solver->GetClassification(Decl) : VariableStates::Safe;
+    info.size = llvm::ConstantInt::get(sizetype, 0);
+    NESCHECK_LOG(Trace) << GREEN << "\t=> Classified " << getIdentifyingName(Decl) << " as " << PtrTypeToString(info.classification) << NORMAL << "\n";
+    if (info.classification != VariableStates::Safe)
+        NESCHECK_REMARK("pointer-classified").attr("variable", *Decl).attr("classification", PtrTypeToString(info.classification)).attr("solved", (int64_t)1);
+    return info;
+}
 
-    Variables[Decl].classification = VariableStates::Safe;
-    Variables[Decl].size = llvm::ConstantInt::get(sizetype, 0);
-    errs() << GREEN << "\t=> Classified " << getIdentifyingName(Decl) << " as SAFE" << NORMAL << "\n";
+VariableInfo & AnalysisState::RegisterVariable(const VariableMapKeyType *Decl) {
+    return LookupOrRegisterVariable(Decl);
 }
-void AnalysisState::ClassifyPointerVariable(const VariableMapKeyType* Decl, VariableStates ptrType) {
-    RegisterVariable(Decl);
+VariableInfo & AnalysisState::ClassifyPointerVariable(const VariableMapKeyType* Decl, VariableStates ptrType) {
+    VariableInfo& info = LookupOrRegisterVariable(Decl);
 
-    if (Variables[Decl].classification < ptrType) {
-        Variables[Decl].classification = ptrType;
-        errs() << GREEN << "\t=> Classified " << getIdentifyingName(Decl) << " as " << PtrTypeToString(ptrType) << NORMAL << "\n";
+    if (info.classification < ptrType) {
+        info.classification = ptrType;
+        NESCHECK_LOG(Trace) << GREEN << "\t=> Classified " << getIdentifyingName(Decl) << " as " << PtrTypeToString(ptrType) << NORMAL << "\n";
+        NESCHECK_REMARK("pointer-classified").attr("variable", *Decl).attr("classification", PtrTypeToString(ptrType));
     } else {
-        errs() << GRAY << "\t=> Ignored classification of " << getIdentifyingName(Decl) << " as " << PtrTypeToString(ptrType) << NORMAL << "\n";
+        NESCHECK_LOG(Trace) << GRAY << "\t=> Ignored classification of " << getIdentifyingName(Decl) << " as " << PtrTypeToString(ptrType) << NORMAL << "\n";
     }
+    return info;
 }
-VariableInfo * AnalysisState::SetSizeForPointerVariable(const VariableMapKeyType* Decl, Value *size) {
-    RegisterVariable(Decl);
+VariableInfo & AnalysisState::SetSizeForPointerVariable(const VariableMapKeyType* Decl, Value *size) {
+    VariableInfo& info = LookupOrRegisterVariable(Decl);
     if (size == NULL) {
-        // Variables[Decl].hasSize = false;
-        Variables[Decl].size = llvm::ConstantInt::get(sizetype, 0);
+        // info.hasSize = false;
+        info.size = llvm::ConstantInt::get(sizetype, 0);
     } else {
-        // Variables[Decl].hasSize = true;
-        Variables[Decl].size = size;
+        // info.hasSize = true;
+        info.size = size;
     }
-    errs() << GREEN << "\t=> Size of " << getIdentifyingName(Decl) << " set to " << *(Variables[Decl].size) << NORMAL << "\n";
-    return &(Variables[Decl]);
-}
-void AnalysisState::SetExplicitSizeVariableForPointerVariable(const VariableMapKeyType *Decl, Value *explicitSize) {
-    RegisterVariable(Decl);
-    Variables[Decl].hasExplicitSizeVariable = (explicitSize != NULL);
-    Variables[Decl].explicitSizeVariable = explicitSize;
-    errs() << GREEN << "\t=> Explicit size variable for " << getIdentifyingName(Decl) << " set to " << *(Variables[Decl].explicitSizeVariable) << NORMAL << "\n";
+    SizedInCurrentFunction.push_back(&info);
+    NESCHECK_LOG(Trace) << GREEN << "\t=> Size of " << getIdentifyingName(Decl) << " set to " << *(info.size) << NORMAL << "\n";
+    return info;
 }
-
-void AnalysisState::SetInstantiatedExplicitSizeVariable(const VariableMapKeyType *Ref, bool v) {
-    RegisterVariable(Ref);
-    Variables[Ref].instantiatedExplicitSizeVariable = v;
+void AnalysisState::ReplaceSizes(const DenseMap<Value*, Value*> &Replacements) {
+    for (VariableInfo* info : SizedInCurrentFunction) {
+        auto entry = Replacements.find(info->size);
+        if (entry != Replacements.end()) info->size = entry->second;
+    }
 }
 
-void AnalysisState::SetHasMetadataTableEntry(const VariableMapKeyType *Ref) {
-    RegisterVariable(Ref);
-    Variables[Ref].hasMetadataTableEntry = true;
+VariableInfo & AnalysisState::SetHasMetadataTableEntry(const VariableMapKeyType *Ref) {
+    VariableInfo& info = LookupOrRegisterVariable(Ref);
+    info.hasMetadataTableEntry = true;
+    return info;
 }
 
 
 VariableInfo * AnalysisState::GetPointerVariableInfo(VariableMapKeyType *Decl) {
-    errs() << GRAY << "\tGetting VarInfo for " << getIdentifyingName(Decl) << "... ";
+    NESCHECK_LOG(Trace) << GRAY << "\tGetting VarInfo for " << getIdentifyingName(Decl) << "... ";
     if (isa<ConstantPointerNull>(Decl)) {
-        VariableInfo* info = new VariableInfo;
-        info->size = llvm::ConstantInt::get(sizetype, 0);
-        return info;
+        return &NullPointerInfo;
     }
-    if (Variables.count(Decl)) {
-        errs() << "found.\n" << NORMAL;
-        return &(Variables[Decl]);
+    auto entry = Variables.find(Decl);
+    if (entry != Variables.end()) {
+        NESCHECK_LOG(Trace) << "found.\n" << NORMAL;
+        return entry->second;
     }
-    errs() << RED << "NOT FOUND!\n" << NORMAL;
+    NESCHECK_LOG(Trace) << RED << "NOT FOUND!\n" << NORMAL;
     return NULL;
 }
 
@@ -82,17 +98,17 @@ std::string AnalysisState::GetVariablesStateAsString() {
 
     int tot;
     _safeptrscount = _seqptrscount = _dynptrscount = _hasmetadatatableentrycount = 0;
-    tot = Variables.size();
+    tot = VariablesStorage.size();
 
     SS << "Found " << numFunctions << " functions.\n";
     SS << "Found " << tot << " pointer variables:\n";
 
-    for (auto iter = Variables.begin(); iter != Variables.end(); ++iter) {
-        if (iter->second.classification == VariableStates::Safe) _safeptrscount++;
-        else if (iter->second.classification == VariableStates::Seq) _seqptrscount++;
-        else if (iter->second.classification == VariableStates::Dyn) _dynptrscount++;
+    for (VariableInfo& info : VariablesStorage) {
+        if (info.classification == VariableStates::Safe) _safeptrscount++;
+        else if (info.classification == VariableStates::Seq) _seqptrscount++;
+        else if (info.classification == VariableStates::Dyn) _dynptrscount++;
 
-        if (iter->second.hasMetadataTableEntry) _hasmetadatatableentrycount++;
+        if (info.hasMetadataTableEntry) _hasmetadatatableentrycount++;
     }
     SS << "-->) TOTAL Safe pointer variables:\t" << _safeptrscount << " (" << (tot > 0 ? _safeptrscount * 1.0 / tot : 0) * 100 << "%)\n";
     SS << "-->) TOTAL Seq pointer variables:\t" << _seqptrscount << " (" << (tot > 0 ? _seqptrscount * 1.0 / tot : 0) * 100 << "%)\n";
@@ -1,13 +1,18 @@
 #pragma once
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "Diagnostics.hpp"
+
+#include <deque>
 #include <sstream>
 #include <string>
 #include <set>
+#include <vector>
 
 
 #define USE_COLORED_OUTPUT 1
@@ -48,9 +53,10 @@ namespace NesCheck {
 	}
 
 	inline static std::string getIdentifyingName(const VariableMapKeyType *Decl) {
-	    char address[11];
-	    sprintf(address, "%p", (const void*) Decl);
-	    return Decl->getName().str() + "[" + address + "]";
+	    std::string name;
+	    raw_string_ostream OS(name);
+	    OS << Decl->getName() << "[" << (const void*) Decl << "]";
+	    return OS.str();
 	}
 
 
@@ -58,28 +64,36 @@ namespace NesCheck {
 		VariableStates classification;
 		Value* size;
 		bool hasMetadataTableEntry;
-		bool hasExplicitSizeVariable;
-		bool instantiatedExplicitSizeVariable;
-		Value* explicitSizeVariable;
 	} VariableInfo;
 
 
 
 
+	class ClassificationSolver;
+
 	class AnalysisState {
 	private:
 		int numFunctions = 0;
-		std::map<VariableMapKeyType const *, VariableInfo> Variables;
+		llvm::Type* sizetype = nullptr;
+		int _safeptrscount = 0, _seqptrscount = 0, _dynptrscount = 0, _hasmetadatatableentrycount = 0;
+		const ClassificationSolver *Solver = nullptr; // initial classification of the variables, if any
+		// the entries live in a deque, so that references to them stay valid while the map grows
+		DenseMap<VariableMapKeyType const *, VariableInfo*> Variables;
+		std::deque<VariableInfo> VariablesStorage;
+		VariableInfo NullPointerInfo; // shared by all the ConstantPointerNull queries
+		std::vector<VariableInfo*> SizedInCurrentFunction; // the entries whose size was set since RegisterFunction
+		VariableInfo & LookupOrRegisterVariable(const VariableMapKeyType *Decl);
 	public:
 		AnalysisState();
 		void SetSizeType(llvm::Type* st);
+		void SetClassificationSolver(const ClassificationSolver *solver);
 		void RegisterFunction(Function *func);
-	    void RegisterVariable(const VariableMapKeyType *Decl);
-	    void ClassifyPointerVariable(const VariableMapKeyType *Ref, VariableStates ptrType);
-	    VariableInfo * SetSizeForPointerVariable(const VariableMapKeyType *Ref, Value *size);
-	    void SetExplicitSizeVariableForPointerVariable(const VariableMapKeyType *Ref, Value *explicitSize);
-	    void SetInstantiatedExplicitSizeVariable(const VariableMapKeyType *Ref, bool v);
-	    void SetHasMetadataTableEntry(const VariableMapKeyType *Ref);
+	    VariableInfo & RegisterVariable(const VariableMapKeyType *Decl);
+	    VariableInfo & ClassifyPointerVariable(const VariableMapKeyType *Ref, VariableStates ptrType);
+	    VariableInfo & SetSizeForPointerVariable(const VariableMapKeyType *Ref, Value *size);
+	    // replaces the sizes set in the current function that are keys of Replacements (e.g., placeholders)
+	    void ReplaceSizes(const DenseMap<Value*, Value*> &Replacements);
+	    VariableInfo & SetHasMetadataTableEntry(const VariableMapKeyType *Ref);
 	    VariableInfo * GetPointerVariableInfo(VariableMapKeyType *Ref);
 
 	    std::string GetVariablesStateAsString();
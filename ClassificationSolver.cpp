@@ -0,0 +1,169 @@
+#include "ClassificationSolver.hpp"
+
+#include <algorithm>
+
+namespace NesCheck {
+
+ClassificationSolver::Node ClassificationSolver::GetNode(const Value *V) {
+    auto inserted = Nodes.insert(std::make_pair(V, (Node)LowerBounds.size()));
+    if (inserted.second) CreateNode();
+    return inserted.first->second;
+}
+
+ClassificationSolver::Node ClassificationSolver::GetReturnNode(const Function *F) {
+    auto inserted = ReturnNodes.insert(std::make_pair(F, (Node)LowerBounds.size()));
+    if (inserted.second) CreateNode();
+    return inserted.first->second;
+}
+
+ClassificationSolver::Node ClassificationSolver::GetNode(const ConstraintShard::Endpoint &E) {
+    return E.ReturnOf ? GetReturnNode(E.ReturnOf) : GetNode(E.V);
+}
+
+ClassificationSolver::Node ClassificationSolver::CreateNode() {
+    assert(!Solved && "constraints added after solving");
+    LowerBounds.push_back(VariableStates::Safe);
+    Flows.emplace_back();
+    return LowerBounds.size() - 1;
+}
+
+void ClassificationSolver::AddLowerBound(Node N, VariableStates ptrType) {
+    LowerBounds[N] = std::max(LowerBounds[N], ptrType);
+}
+
+void ClassificationSolver::AddFlow(Node From, Node To) {
+    if (From == To) return;
+    Flows[From].push_back(To);
+    FlowCount++;
+}
+
+void ClassificationSolver::AddConstraints(const ConstraintShard &Shard) {
+    for (const ConstraintShard::Flow &F : Shard.Flows)
+        AddFlow(GetNode(F.From), GetNode(F.To));
+    for (auto &bound : Shard.LowerBounds)
+        AddLowerBound(GetNode(bound.first), bound.second);
+}
+
+ClassificationSolver::Node ClassificationSolver::Find(Node N) {
+    while (Parent[N] != N) {
+        Parent[N] = Parent[Parent[N]];
+        N = Parent[N];
+    }
+    return N;
+}
+
+ClassificationSolver::Node ClassificationSolver::Union(Node A, Node B) {
+    A = Find(A);
+    B = Find(B);
+    if (A == B) return A;
+    if (Rank[A] < Rank[B]) std::swap(A, B);
+    Parent[B] = A;
+    if (Rank[A] == Rank[B]) Rank[A]++;
+    LowerBounds[A] = std::max(LowerBounds[A], LowerBounds[B]);
+    return A;
+}
+
+void ClassificationSolver::Solve() {
+    unsigned N = LowerBounds.size();
+    Parent.resize(N);
+    Rank.assign(N, 0);
+    for (Node i = 0; i < N; i++) Parent[i] = i;
+
+    // iterative Tarjan: every strongly connected component is merged into one class, and the
+    // components come out sinks first
+    const unsigned Unvisited = ~0u;
+    std::vector<unsigned> Index(N, Unvisited), LowLink(N, 0);
+    std::vector<bool> OnStack(N, false);
+    std::vector<Node> Stack;
+    std::vector<std::pair<Node, unsigned>> Visiting; // node, next flow to follow
+    std::vector<Node> Components;
+    unsigned NextIndex = 0;
+
+    for (Node Root = 0; Root < N; Root++) {
+        if (Index[Root] != Unvisited) continue;
+        Index[Root] = LowLink[Root] = NextIndex++;
+        Stack.push_back(Root);
+        OnStack[Root] = true;
+        Visiting.push_back(std::make_pair(Root, 0u));
+
+        while (!Visiting.empty()) {
+            Node V = Visiting.back().first;
+            unsigned next = Visiting.back().second;
+            if (next < Flows[V].size()) {
+                Visiting.back().second++;
+                Node W = Flows[V][next];
+                if (Index[W] == Unvisited) {
+                    Index[W] = LowLink[W] = NextIndex++;
+                    Stack.push_back(W);
+                    OnStack[W] = true;
+                    Visiting.push_back(std::make_pair(W, 0u));
+                } else if (OnStack[W]) {
+                    LowLink[V] = std::min(LowLink[V], Index[W]);
+                }
+                continue;
+            }
+
+            Visiting.pop_back();
+            if (!Visiting.empty()) {
+                Node P = Visiting.back().first;
+                LowLink[P] = std::min(LowLink[P], LowLink[V]);
+            }
+            if (LowLink[V] != Index[V]) continue;
+
+            Node W;
+            do {
+                W = Stack.back();
+                Stack.pop_back();
+                OnStack[W] = false;
+                Union(V, W);
+            } while (W != V);
+            Components.push_back(Find(V));
+        }
+    }
+    ComponentCount = Components.size();
+
+    // every flow leads to the same or to an earlier component, so going through them sources
+    // first pushes each bound to all the components it reaches in a single pass
+    std::vector<std::vector<Node>> Members(N);
+    for (Node i = 0; i < N; i++) Members[Find(i)].push_back(i);
+    for (auto C = Components.rbegin(), E = Components.rend(); C != E; ++C) {
+        for (Node M : Members[*C]) {
+            for (Node W : Flows[M]) {
+                Node L = Find(W);
+                LowerBounds[L] = std::max(LowerBounds[L], LowerBounds[*C]);
+            }
+        }
+    }
+
+    // flatten the forest, so that lookups don't need to mutate it
+    for (Node i = 0; i < N; i++) Parent[i] = Find(i);
+    Flows.clear();
+    Solved = true;
+}
+
+void ClassificationSolver::AddAlias(const Value *NewV, const Value *OldV) {
+    auto entry = Nodes.find(OldV);
+    if (entry == Nodes.end()) return;
+    Node N = entry->second;
+    Nodes[NewV] = N;
+}
+
+VariableStates ClassificationSolver::GetClassification(const Value *V) const {
+    if (!Solved) return VariableStates::Safe;
+    auto entry = Nodes.find(V);
+    if (entry == Nodes.end()) return VariableStates::Safe;
+    return LowerBounds[Parent[entry->second]];
+}
+
+void ClassificationSolver::Clear() {
+    Nodes.clear();
+    ReturnNodes.clear();
+    LowerBounds.clear();
+    Flows.clear();
+    Parent.clear();
+    Rank.clear();
+    FlowCount = ComponentCount = 0;
+    Solved = false;
+}
+
+}
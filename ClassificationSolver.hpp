@@ -0,0 +1,86 @@
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Value.h"
+
+#include <vector>
+
+#include "AnalysisState.hpp"
+
+
+using namespace llvm;
+
+namespace NesCheck {
+
+	// The constraints of one function, generated without touching the solver, so that the functions can
+	// be processed in parallel and their constraints added to the solver in a deterministic order.
+	// An endpoint with ReturnOf set stands for the return value of that function.
+	class ConstraintShard {
+	public:
+		struct Endpoint {
+			const Value *V;
+			const Function *ReturnOf;
+		};
+		struct Flow {
+			Endpoint From, To;
+		};
+
+		void AddFlow(const Value *From, const Value *To) { Flows.push_back({ { From, nullptr }, { To, nullptr } }); }
+		void AddFlowToReturn(const Value *From, const Function *F) { Flows.push_back({ { From, nullptr }, { nullptr, F } }); }
+		void AddFlowFromReturn(const Function *F, const Value *To) { Flows.push_back({ { nullptr, F }, { To, nullptr } }); }
+		void AddLowerBound(const Value *V, VariableStates ptrType) { LowerBounds.push_back(std::make_pair(V, ptrType)); }
+
+	private:
+		friend class ClassificationSolver;
+		friend class AnalysisCache;
+		std::vector<Flow> Flows;
+		std::vector<std::pair<const Value*, VariableStates>> LowerBounds;
+	};
+
+	// Whole-module CCured classification, as the least fixpoint of a set of constraints: every pointer
+	// starts out SAFE, a lower bound forces it to at least SEQ or DYN (e.g., pointer arithmetic), and a
+	// flow From -> To makes To at least as unsafe as From (e.g., a store of From into the slot To).
+	// Cycles of flows (the -O0 stack slots of loops) are found with Tarjan's algorithm and merged into
+	// union-find classes, then the bounds are propagated once in topological order, so solving takes
+	// linear time in the number of constraints.
+	class ClassificationSolver {
+	public:
+		typedef unsigned Node;
+
+		Node GetNode(const Value *V);
+		Node CreateNode(); // a node not bound to any value
+		Node GetReturnNode(const Function *F);
+		void AddLowerBound(Node N, VariableStates ptrType);
+		void AddFlow(Node From, Node To);
+		void AddConstraints(const ConstraintShard &Shard);
+		void Solve();
+
+		// makes NewV share the (solved) classification of OldV, e.g., the arguments of a rewritten function
+		void AddAlias(const Value *NewV, const Value *OldV);
+		// the solved classification of V, SAFE if no constraint involves it
+		VariableStates GetClassification(const Value *V) const;
+
+		unsigned GetNodeCount() const { return LowerBounds.size(); }
+		unsigned GetFlowCount() const { return FlowCount; }
+		unsigned GetComponentCount() const { return ComponentCount; }
+		void Clear();
+
+	private:
+		DenseMap<const Value*, Node> Nodes;
+		DenseMap<const Function*, Node> ReturnNodes;
+		std::vector<VariableStates> LowerBounds; // per node, then per class leader once solved
+		std::vector<SmallVector<Node, 2>> Flows;
+		std::vector<Node> Parent; // union-find forest
+		std::vector<unsigned> Rank;
+		unsigned FlowCount = 0;
+		unsigned ComponentCount = 0;
+		bool Solved = false;
+
+		Node Find(Node N);
+		Node Union(Node A, Node B);
+		Node GetNode(const ConstraintShard::Endpoint &E);
+	};
+
+}
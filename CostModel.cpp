@@ -0,0 +1,90 @@
+#include "CostModel.hpp"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace NesCheck {
+
+static cl::opt<unsigned> ClLoopTrips("nescheck-cost-loop-trips",
+    cl::desc("Iterations assumed for every loop by the cost model"),
+    cl::init(10));
+
+// cycles and bytes of code of one instance of each kind, in CostKind order. The calls into the runtime
+// count the argument setup and the call at the site, and the average work of the runtime for the cycles
+static const Cost UnitCosts[NumCostKinds] = {
+    {   5, 16 }, // Check: subtract, compare, branch, and the site constants for the trap block
+    {  12, 32 }, // RangeCheck: two compares against the first and last offset
+    {  40, 10 }, // MetadataLookup: hash and probe of the table
+    {  12, 44 }, // CachedLookup: the hit path, the miss path is a MetadataLookup
+    {  50, 14 }, // MetadataUpdate: probe, insertion, epoch bump
+    {  60, 12 }, // MetadataRemoval: a range, usually a few probes
+    {   4, 12 }, // ShadowAccess: shift, add, load or store
+    {   2,  6 }, // FatPointerAccess: one more load or store next to the pointer
+    {   1,  4 }, // SizeArgument: one more argument or return register
+};
+
+Cost CostModel::Of(CostKind Kind, unsigned LoopDepth) {
+    Cost C = UnitCosts[(unsigned)Kind];
+    C.Cycles *= Frequency(LoopDepth);
+    return C;
+}
+
+double CostModel::Frequency(unsigned LoopDepth) {
+    return std::pow((double)ClLoopTrips, (double)LoopDepth);
+}
+
+void CostModel::AddBase(const Function *F, unsigned Instructions, unsigned LoopDepth) {
+    Functions[F].BaseCycles += Instructions * Frequency(LoopDepth);
+}
+
+void CostModel::Add(const Function *F, CostKind Kind, unsigned LoopDepth) {
+    FunctionCost &FC = Functions[F];
+    FC.Added += Of(Kind, LoopDepth);
+    FC.Counts[(unsigned)Kind]++;
+}
+
+void CostModel::Remove(const Function *F, CostKind Kind, unsigned LoopDepth) {
+    FunctionCost &FC = Functions[F];
+    assert(FC.Counts[(unsigned)Kind] > 0 && "removing a cost that was never added");
+    FC.Added -= Of(Kind, LoopDepth);
+    FC.Counts[(unsigned)Kind]--;
+}
+
+Cost CostModel::Total() const {
+    Cost Total;
+    for (auto &entry : Functions) Total += entry.second.Added;
+    return Total;
+}
+
+void CostModel::Print(raw_ostream &OS) const {
+    typedef std::pair<const Function*, FunctionCost> Entry;
+    std::vector<const Entry*> Sorted;
+    for (auto &entry : Functions) Sorted.push_back(&entry);
+    std::stable_sort(Sorted.begin(), Sorted.end(), [](const Entry *a, const Entry *b) {
+        return a->second.Added.Cycles > b->second.Added.Cycles;
+    });
+
+    OS << "\tfunction\tbytes\tcycles/call\toverhead\tchecks\tlookups\tupdates\tremovals\tinline\tsize args\n";
+    for (auto *entry : Sorted) {
+        const FunctionCost &FC = entry->second;
+        auto count = [&FC](CostKind Kind) { return FC.Counts[(unsigned)Kind]; };
+        OS << "\t" << entry->first->getName() << "\t" << (uint64_t)FC.Added.Bytes << "\t"
+           << format("%.0f", FC.Added.Cycles) << "\t";
+        if (FC.BaseCycles > 0)
+            OS << format("%.1f%%", FC.Added.Cycles * 100 / FC.BaseCycles);
+        else
+            OS << "-";
+        OS << "\t" << count(CostKind::Check) + count(CostKind::RangeCheck)
+           << "\t" << count(CostKind::MetadataLookup) + count(CostKind::CachedLookup)
+           << "\t" << count(CostKind::MetadataUpdate)
+           << "\t" << count(CostKind::MetadataRemoval)
+           << "\t" << count(CostKind::ShadowAccess) + count(CostKind::FatPointerAccess)
+           << "\t" << count(CostKind::SizeArgument) << "\n";
+    }
+}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+
+
+using namespace llvm;
+
+namespace NesCheck {
+
+	// What the instrumentation adds to a function, as far as the cost model is concerned
+	enum class CostKind {
+		Check,            // bounds check of one access
+		RangeCheck,       // check of all the offsets of a loop, in its preheader
+		MetadataLookup,   // call to lookupMetadataTableEntry
+		CachedLookup,     // lookup behind an inline one-entry cache (-nescheck-lookup-cache)
+		MetadataUpdate,   // call to setMetadataTableEntry
+		MetadataRemoval,  // call to removeMetadataTableRange or moveMetadataTableRange
+		ShadowAccess,     // inline shadow memory lookup or update (-nescheck-shadow-memory)
+		FatPointerAccess, // load or store of the size next to a pointer (-nescheck-fat-pointers)
+		SizeArgument,     // size passed along with a pointer argument or return value
+	};
+	static const unsigned NumCostKinds = (unsigned)CostKind::SizeArgument + 1;
+
+	struct Cost {
+		double Cycles = 0; // per call of the function
+		double Bytes = 0;
+
+		Cost & operator+=(const Cost &Other) {
+			Cycles += Other.Cycles;
+			Bytes += Other.Bytes;
+			return *this;
+		}
+		Cost & operator-=(const Cost &Other) {
+			Cycles -= Other.Cycles;
+			Bytes -= Other.Bytes;
+			return *this;
+		}
+	};
+
+	// Static estimate of the cost of the instrumentation of every function: the bytes of code it adds,
+	// and the cycles it adds per call of the function, where code in a loop of depth d runs
+	// -nescheck-cost-loop-trips^d times. The unit costs are rough figures for a 16-bit mote core: they
+	// only mean something relative to each other and to the cycles of the code of the function itself.
+	class CostModel {
+	public:
+		struct FunctionCost {
+			double BaseCycles = 0; // of the code of the function before instrumentation
+			Cost Added;
+			unsigned Counts[NumCostKinds] = {};
+		};
+
+		static Cost Of(CostKind Kind, unsigned LoopDepth);
+		// how many times code in a loop of the given depth runs per call of its function
+		static double Frequency(unsigned LoopDepth);
+
+		void AddBase(const Function *F, unsigned Instructions, unsigned LoopDepth);
+		void Add(const Function *F, CostKind Kind, unsigned LoopDepth);
+		void Remove(const Function *F, CostKind Kind, unsigned LoopDepth);
+
+		const FunctionCost & Get(const Function *F) { return Functions[F]; }
+		Cost Total() const;
+		// one line per function, most expensive first
+		void Print(raw_ostream &OS) const;
+
+	private:
+		MapVector<const Function*, FunctionCost> Functions;
+	};
+
+}
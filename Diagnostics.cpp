@@ -0,0 +1,133 @@
+#include "Diagnostics.hpp"
+
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+
+#include <memory>
+#include <sys/resource.h>
+
+namespace NesCheck {
+
+unsigned LogVerbosity;
+bool RemarksEnabled = false;
+
+static cl::opt<unsigned, true> ClVerbosity("nescheck-verbosity",
+    cl::desc("Verbosity of the nesCheck log: 0 = errors, 1 = stats summary, 2 = functions, 3 = every instruction"),
+    cl::location(LogVerbosity), cl::init((unsigned)Verbosity::Summary));
+static cl::opt<std::string> ClRemarks("nescheck-remarks",
+    cl::desc("Write machine-readable remarks (one JSON object per line) about every analysis and instrumentation decision"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<bool> ClTimePhases("nescheck-time-phases",
+    cl::desc("Print the wall time, user time and peak RSS of each phase of the pass"),
+    cl::init(false));
+
+static std::unique_ptr<raw_fd_ostream> RemarksStream;
+
+raw_ostream & LogStream() {
+    return errs();
+}
+
+void InitDiagnostics() {
+    if (ClRemarks.empty() || RemarksStream) return;
+
+    std::error_code EC;
+    RemarksStream.reset(new raw_fd_ostream(ClRemarks, EC, sys::fs::F_Text));
+    if (EC) {
+        NESCHECK_LOG(Error) << "Unable to write remarks to " << ClRemarks << ": " << EC.message() << "\n";
+        RemarksStream.reset();
+        return;
+    }
+    RemarksEnabled = true;
+}
+
+void CloseRemarksStream() {
+    RemarksEnabled = false;
+    RemarksStream.reset();
+}
+
+PhaseTimer::PhaseTimer(const char *name) : Name(name) {
+    if (ClTimePhases) Start = TimeRecord::getCurrentTime(true);
+}
+
+PhaseTimer::~PhaseTimer() {
+    if (!ClTimePhases) return;
+    TimeRecord Elapsed = TimeRecord::getCurrentTime(false);
+    Elapsed -= Start;
+
+    // the peak so far, in KB on Linux (bytes on OS X)
+    struct rusage usage;
+    long maxrss = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;
+
+    LogStream() << format("nescheck-phase %s wall %.6f user %.6f maxrss %ld\n", Name, Elapsed.getWallTime(), Elapsed.getUserTime(), maxrss);
+    NESCHECK_REMARK("phase-time").attr("phase", Name)
+        .attr("wall-us", (int64_t)(Elapsed.getWallTime() * 1e6)).attr("user-us", (int64_t)(Elapsed.getUserTime() * 1e6))
+        .attr("maxrss-kb", (int64_t)maxrss);
+}
+
+
+static void writeJSONString(raw_ostream &OS, StringRef S) {
+    OS << '"';
+    for (char c : S) {
+        switch (c) {
+            case '"':  OS << "\\\""; break;
+            case '\\': OS << "\\\\"; break;
+            case '\n': OS << "\\n"; break;
+            case '\t': OS << "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) OS << format("\\u%04x", c);
+                else OS << c;
+        }
+    }
+    OS << '"';
+}
+
+Remark::Remark(StringRef kind) : OS(Buffer) {
+    OS << "{\"remark\":";
+    writeJSONString(OS, kind);
+}
+
+Remark::~Remark() {
+    OS << "}\n";
+    *RemarksStream << OS.str();
+}
+
+Remark & Remark::in(const Function *F) {
+    return attr("function", F->getName());
+}
+
+Remark & Remark::at(const Instruction *I) {
+    in(I->getParent()->getParent());
+    if (MDNode *N = (MDNode*)(I->getMetadata("dbg"))) {
+        DILocation Loc(N);
+        attr("line", (int64_t)Loc.getLineNumber());
+    }
+    return *this;
+}
+
+Remark & Remark::attr(StringRef key, StringRef value) {
+    OS << ",";
+    writeJSONString(OS, key);
+    OS << ":";
+    writeJSONString(OS, value);
+    return *this;
+}
+
+Remark & Remark::attr(StringRef key, const Value &value) {
+    std::string S;
+    raw_string_ostream VS(S);
+    if (isa<Function>(value)) VS << value.getName();
+    else VS << value;
+    return attr(key, StringRef(VS.str()).trim());
+}
+
+Remark & Remark::attr(StringRef key, int64_t value) {
+    OS << ",";
+    writeJSONString(OS, key);
+    OS << ":" << value;
+    return *this;
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+
+
+using namespace llvm;
+
+namespace NesCheck {
+
+	// Verbosity levels of the textual log (-nescheck-verbosity):
+	//   Error   - problems that the user has to fix
+	//   Summary - the stats summary at the end of the pass (default)
+	//   Info    - one line per module/function/signature rewrite
+	//   Trace   - every analyzed instruction and every decision taken on it
+	enum class Verbosity {
+		Error = 0,
+		Summary = 1,
+		Info = 2,
+		Trace = 3,
+	};
+
+	extern unsigned LogVerbosity;
+	extern bool RemarksEnabled;
+
+	inline bool IsLogEnabled(Verbosity level) {
+		return LogVerbosity >= (unsigned)level;
+	}
+	raw_ostream & LogStream();
+
+	// A machine-readable remark, written as one JSON object per line to the -nescheck-remarks file
+	// when the remark goes out of scope. Only build them through NESCHECK_REMARK, so that nothing is
+	// formatted when remarks are disabled.
+	class Remark {
+	private:
+		std::string Buffer;
+		raw_string_ostream OS;
+	public:
+		Remark(StringRef kind);
+		~Remark();
+		Remark & at(const Instruction *I);
+		Remark & in(const Function *F);
+		Remark & attr(StringRef key, StringRef value);
+		Remark & attr(StringRef key, const Value &value);
+		Remark & attr(StringRef key, int64_t value);
+	};
+
+	// Times one phase of the pass for -nescheck-time-phases, from construction to destruction. Each phase
+	// prints one line with its wall and user time, and the peak RSS of the process at its end:
+	//   nescheck-phase <name> wall <seconds> user <seconds> maxrss <KB>
+	// and, with -nescheck-remarks, a "phase-time" remark with the same numbers.
+	class PhaseTimer {
+	private:
+		const char *Name;
+		TimeRecord Start;
+	public:
+		PhaseTimer(const char *name);
+		~PhaseTimer();
+	};
+
+	// Opens the -nescheck-remarks file, if any; call once at the start of the pass
+	void InitDiagnostics();
+	void CloseRemarksStream();
+
+}
+
+// NESCHECK_LOG(Trace) << ...; evaluates and formats its operands only if the verbosity is high enough
+#define NESCHECK_LOG(level) \
+	if (!::NesCheck::IsLogEnabled(::NesCheck::Verbosity::level)) ; else ::NesCheck::LogStream()
+
+// NESCHECK_REMARK("check-added").at(I).attr("size", *Size); is a no-op unless -nescheck-remarks is given
+#define NESCHECK_REMARK(kind) \
+	if (!::NesCheck::RemarksEnabled) ; else ::NesCheck::Remark(kind)
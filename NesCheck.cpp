@@ -1,16 +1,30 @@
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Function.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/IR/LLVMContext.h"
 
 #include "llvm/Transforms/Instrumentation.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/TargetFolder.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Intrinsics.h"
@@ -18,17 +32,29 @@
 #include "llvm/IR/ValueSymbolTable.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/DebugInfo.h"
-
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+
+#include "AnalysisCache.hpp"
 #include "AnalysisState.hpp"
+#include "ClassificationSolver.hpp"
+#include "CostModel.hpp"
+#include "Diagnostics.hpp"
 
+#include <atomic>
+#include <functional>
 #include <list>
+#include <thread>
 #include <time.h>
 
 using namespace llvm;
 
-#define IS_DEBUGGING 0
-#define IS_NAIVE 0
-
 #define DEBUG_TYPE "nescheck"
 
 #define CONTAINS(v, e) (std::find(v.begin(), v.end(), e) != v.end())
@@ -43,14 +69,121 @@ STATISTIC(ChecksAlwaysTrue, "Checks always true (memory bugs)");
 STATISTIC(ChecksAlwaysFalse, "Checks always false (unnecessary)");
 STATISTIC(ChecksSkippedForSafe, "Checks skipped (SAFE pointer)");
 STATISTIC(ChecksUnable, "Bounds checks unable to add");
+STATISTIC(ChecksRedundant, "Checks removed as implied by a dominating check");
+STATISTIC(ChecksCoalesced, "Checks merged into an earlier check in the same block");
+STATISTIC(ChecksHoisted, "Checks hoisted out of loops");
+STATISTIC(ChecksHoistedLoops, "Loops with a hoisted range check");
+STATISTIC(ChecksProfiled, "Checks found in the execution profile");
+STATISTIC(ChecksHoistedProfiled, "Hoisted checks found in the execution profile");
+STATISTIC(ChecksDroppedForBudget, "Checks dropped to fit the budget");
+STATISTIC(CacheHits, "Function summaries loaded from the analysis cache");
+STATISTIC(CacheMisses, "Function summaries computed (not in the analysis cache)");
 STATISTIC(FunctionSignaturesRewritten, "Function signatures rewritten");
+STATISTIC(SizeParamsOmitted, "Pointer parameters without a size argument");
 STATISTIC(FunctionCallSitesRewritten, "Function call sites rewritten");
 STATISTIC(MetadataTableLookups, "Metadata table lookups");
 STATISTIC(MetadataTableUpdates, "Metadata table updates");
+STATISTIC(MetadataTableRemovals, "Metadata table removals");
+STATISTIC(MetadataTableRemovalsSkipped, "Metadata table removals and moves skipped for blocks of unknown size");
+STATISTIC(MetadataTableCachedLookups, "Metadata table lookups with an inline cache");
 STATISTIC(NesCheckVariablesWithMetadataTableEntries, "Variables with metadata table entries");
+STATISTIC(MetadataTableSizeBound, "Metadata table entries (an upper bound only if there are no unbounded update sites)");
+STATISTIC(MetadataTableUnboundedSites, "Metadata table update sites without a static bound on their entries");
+STATISTIC(FatPointerArrays, "Arrays of pointers stored as fat pointers");
+STATISTIC(FatPointerAccesses, "Metadata table accesses replaced by fat pointer size fields");
+
+static cl::opt<bool> ClShadowMemory("nescheck-shadow-memory",
+    cl::desc("Use the direct-mapped shadow memory metadata backend, with inline lookups and updates "
+             "(the runtime must be built with -DNESCHECK_SHADOW_MEMORY)"),
+    cl::init(false));
+static cl::opt<unsigned long long> ClShadowOffset("nescheck-shadow-offset",
+    cl::desc("Base address of the metadata shadow memory (must match NESCHECK_SHADOW_OFFSET)"),
+    cl::init(0x100000000000ULL));
+static cl::opt<bool> ClLookupCache("nescheck-lookup-cache",
+    cl::desc("Inject an inline one-entry cache (last slot -> size) in front of every metadata table lookup"),
+    cl::init(false));
+static cl::opt<bool> ClCountChecks("nescheck-count-checks",
+    cl::desc("Count the executions of every bounds check site, dumped at exit to $NESCHECK_PROFILE (default nescheck_profile.csv), "
+             "and of the checks left after the check optimizations, in checksexecuted"),
+    cl::init(false));
+static cl::opt<std::string> ClProfile("nescheck-profile",
+    cl::desc("Execution profile of the checks (as dumped by a -nescheck-count-checks build), used to weight "
+             "the branches to the trap blocks and to rank the checks"),
+    cl::value_desc("filename"), cl::init(""));
+static cl::opt<unsigned> ClProfileReportTop("nescheck-profile-report-top",
+    cl::desc("Number of hottest checks to report when a profile is given"), cl::init(10));
+static cl::opt<bool> ClEliminateRedundantChecks("nescheck-eliminate-redundant-checks",
+    cl::desc("Remove the checks implied by a dominating check on the same pointer and size"),
+    cl::init(true));
+static cl::opt<bool> ClCoalesceChecks("nescheck-coalesce-checks",
+    cl::desc("Merge the checks on the same pointer within a basic block into one check of the maximum offset, "
+             "at the first access (out-of-bounds accesses then trap at the first access of the block)"),
+    cl::init(true));
+static cl::opt<bool> ClHoistLoopChecks("nescheck-hoist-loop-checks",
+    cl::desc("Replace the checks of affine offsets inside loops with a single range check in the loop preheader "
+             "(out-of-bounds accesses then trap before entering the loop)"),
+    cl::init(false));
+static cl::opt<bool> ClFatPointers("nescheck-fat-pointers",
+    cl::desc("Store the size of the pointers in module-private arrays of pointers next to each pointer ({ptr, size}), instead of in the metadata table"),
+    cl::init(false));
+
+static cl::opt<bool> ClNaive("nescheck-naive",
+    cl::desc("Naive instrumentation, as a baseline for the optimizations: also check the accesses that are statically "
+             "in bounds, and keep every check (no redundant check elimination, coalescing or hoisting)"),
+    cl::init(false));
+static cl::opt<bool> ClDebugChecks("nescheck-debug-checks",
+    cl::desc("Call printCheck() before every bounds check (it prints when the runtime is built with -DIS_DEBUGGING)"),
+    cl::init(false));
+
+static cl::opt<bool> ClCostReport("nescheck-cost-report",
+    cl::desc("Print the code size and cycles that the instrumentation is estimated to add to every function"),
+    cl::init(false));
+static cl::opt<unsigned> ClBudgetBytes("nescheck-budget-bytes",
+    cl::desc("Drop checks until the code added to the module by the instrumentation is estimated to fit in this many bytes (0 = no limit)"),
+    cl::init(0));
+static cl::opt<unsigned> ClBudgetOverhead("nescheck-budget-overhead",
+    cl::desc("Drop checks until the cycles added to every function are estimated to be at most this percentage "
+             "of the cycles of the function itself (0 = no limit)"),
+    cl::init(0));
+
+static cl::opt<std::string> ClPoolSizeHeader("nescheck-pool-size-header",
+    cl::desc("Write a C header defining NESCHECK_METADATA_POOL_SIZE for the mote runtime (-DNESCHECK_MOTE)"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<unsigned> ClThreads("nescheck-threads",
+    cl::desc("Number of threads for the read-only analyses of the functions, i.e., the classification constraints "
+             "and the size parameter summaries (0 = one per core). Size discovery and instrumentation are serial"),
+    cl::init(0));
+
+static cl::opt<std::string> ClCacheDir("nescheck-cache-dir",
+    cl::desc("Directory where the per-function analysis results are cached across builds, keyed by a hash of the function"),
+    cl::value_desc("directory"), cl::init(""));
 
 typedef IRBuilder<true, TargetFolder> BuilderTy;
 
+// runs Body(i) for each i in [0, n) on up to -nescheck-threads threads. Body may only read the IR
+// and whatever state is not written until all the calls have returned
+static void parallelFor(unsigned n, const std::function<void(unsigned)>& Body) {
+    unsigned threads = ClThreads ? ClThreads : std::thread::hardware_concurrency();
+    threads = std::min(threads, n);
+    if (threads <= 1 || !llvm_is_multithreaded()) {
+        for (unsigned i = 0; i < n; i++) Body(i);
+        return;
+    }
+
+    std::atomic<unsigned> next(0);
+    auto worker = [&]() {
+        for (unsigned i = next++; i < n; i = next++) Body(i);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker);
+    worker();
+    for (std::thread& thread : pool) thread.join();
+}
+
+// weight of the not-taken edge of the branches to the trap, relative to 1 for the trap, without a profile
+static const uint32_t TrapUnlikelyWeight = 1 << 20;
+
 namespace {
 
 
@@ -69,23 +202,96 @@ private:
     BuilderTy *Builder;
     
     NesCheck::AnalysisState TheState;
+    NesCheck::ClassificationSolver Classification;
     Type* MySizeType;
     ConstantInt* UnknownSizeConstInt;
+    ConstantInt* WhitelistedSizeConstInt; // size of the pointers looked up in functions whitelisted for instrumentation
+    SmallPtrSet<Value*, 2> UnknownSizes; // the sizes that stand for a size the pass does not know
 
     std::vector<std::string> WhitelistedFunctions;
     bool isCurrentFunctionWhitelisted = false; // function excluded from both analysis and instrumentation
     bool isCurrentFunctionWhitelistedForInstrumentation = false; // function excluded from instrumentation but included in analysis
     
     BasicBlock *TrapBB = nullptr;
+    PHINode *TrapSitePHI = nullptr; // site ID of the failed check, one incoming value per branch to the TrapBB
+    PHINode *TrapLinePHI = nullptr;
+
+    // a bounds check added by instrumentGEP. The ordinal numbers the checks considered in the function, so
+    // (function, ordinal) stays the same across builds as long as the function does not change
+    struct CheckSite {
+        std::string function;
+        unsigned ordinal;
+        long line;
+        int64_t profileCount; // executions in the profile, -1 if unknown
+    };
+    std::vector<CheckSite> CheckSites; // indexed by site ID
+
+    // a bounds check added by instrumentGEP, where Br jumps to the TrapBB if Limit < Offset
+    struct BoundsCheck {
+        BranchInst* Br;
+        Value* Base;          // pointer operand of the checked GEP
+        Value* Size;          // size of the object the pointer refers to
+        Value* Limit;         // Size minus AccessSize, i.e., the highest offset that can be accessed
+        Value* Offset;        // offset of the access from the base of the object
+        uint64_t AccessSize;
+        unsigned siteID;
+        unsigned Region;      // original basic block of the access
+        unsigned LoopDepth;   // of the access, for the cost model
+        NesCheck::CostKind Kind; // Check, or RangeCheck for the check of a loop in its preheader
+    };
+    std::vector<BoundsCheck> CurrentFunctionChecks; // conditional checks only, in the order they were added
+    std::vector<std::pair<PHINode*, PHINode*>> CurrentFunctionSizePHIs; // pointer PHI, its size PHI (to fill in)
+    std::vector<std::pair<CallInst*, unsigned>> CurrentFunctionMetadataRemovals; // removals and moves, with their region
+
+    // the size of the pointer held by a slot (the pointer operand of the loads and stores of pointers) of the
+    // current function, as SSA values: the Updater knows the size at the end of every block that sets it,
+    // and LastSize is the size after the last load or store processed, in LastBlock
+    struct SlotSizes {
+        SSAUpdater Updater;
+        BasicBlock* LastBlock;
+        Value* LastSize;
+    };
+    DenseMap<Instruction*, std::unique_ptr<SlotSizes>> CurrentFunctionSlotSizes;
+    // sizes loaded at the start of a block, which can only be known once all the stores have been processed
+    std::vector<std::pair<PHINode*, SlotSizes*>> CurrentFunctionSizePlaceholders;
+    unsigned CurrentRegion = 0;
+    unsigned CurrentFunctionCheckOrdinal = 0;
+    Function* CurrentFunction = nullptr;
+    GlobalVariable* CheckSiteCounters = nullptr; // [0 x i64] placeholder until the number of sites is known
+    GlobalVariable* ChecksExecuted = nullptr; // checksexecuted in the runtime, with -nescheck-count-checks
+    DenseMap<BranchInst*, StoreInst*> ExecutedCheckCounters; // branch of a check -> its ++checksexecuted
+    std::map<std::pair<std::string, unsigned>, uint64_t> CheckProfile; // (function, ordinal) -> executions
+    uint64_t HoistedProfileExecutions = 0; // executions in the profile of the checks hoisted out of loops
+
+    NesCheck::CostModel Costs; // only filled in if isCostModelEnabled()
+    std::vector<unsigned> CurrentFunctionLoopDepths; // indexed by region
+    std::vector<BoundsCheck> BudgetedChecks; // the checks left in every function, for -nescheck-budget-bytes
+    std::vector<unsigned> DroppedSites; // site IDs of the checks dropped to fit the budget
 
     std::vector<Instruction*> InstrumentationWorkList;
-    std::vector<Function*> FunctionsAddedWithNewReturnType;
-    std::vector<Function*> FunctionsToRemove;
-
-    Function* MyPrintErrorLineFn;
+    SmallPtrSet<Function*, 32> FunctionsAddedWithNewReturnType;
+    std::map<Function*, std::vector<bool>> ParamsNeedingSize; // pointer parameters that get a size argument
+    std::vector<Function*> SummarizedFunctions; // the functions of the module that get analyzed, in module order
+    std::vector<NesCheck::FunctionSummary> FunctionSummaries; // one per function in SummarizedFunctions
+    std::vector<Function*> FunctionsToRemove; // in rewrite order, each with its clone in RewrittenFunctions
+    DenseMap<Function*, Function*> RewrittenFunctions; // old function -> its _nesCheck clone
+
+    // statically allocated objects holding pointers that get a metadata table entry, with the number
+    // of pointer slots each can hold, and the number of update sites on any other (e.g., heap) memory.
+    // Only the globals give a bound: a stack object lives at a different address in every frame
+    std::map<const Value*, uint64_t> MetadataTableStaticObjects;
+    DenseMap<const Value*, StructType*> FatPointerSlots; // address of a pointer in a fat pointer array -> {ptr, size}
+    uint64_t MetadataTableDynamicUpdateSites = 0;
+
+    Function* MyReportCheckFailureFn;
     Function* MyPrintCheckFn;
     Function* setMetadataFunction;
     Function* lookupMetadataFunction;
+    Function* removeMetadataRangeFunction;
+    Function* moveMetadataRangeFunction;
+    GlobalVariable* metadataTableEpoch;
+    GlobalVariable* metadataTableNode; // the node of the active table, in runtimes with per-node tables
+    GlobalVariable* nodeId;
 
     // counts the number of pointer indirection for a type (e.g. for "int**" would be 2)
     int countIndirections(Type* T) {
@@ -99,19 +305,52 @@ private:
         PointerType *innerT = dyn_cast_or_null<PointerType>(T);
         return unwrapPointer(innerT->getElementType());
     }
+    // a cast of a pointer that changes the number of indirections or the kind of pointee, which makes it DYN
+    bool isIncompatiblePointerCast(CastInst* II) {
+        Type *srcT = II->getSrcTy();
+        Type *dstT = II->getDestTy();
+        if (!(srcT->isPointerTy())) return false;
+        return countIndirections(srcT) != countIndirections(dstT) ||
+               unwrapPointer(srcT)->isIntegerTy() != unwrapPointer(dstT)->isIntegerTy();
+    }
 
 
 
 
+    // computes the address of the shadow entry of the pointer slot Ptr, at the current insert point
+    // (must match SHADOW_ENTRY in neschecklib.c: 32-bit entries, one every 8 bytes)
+    Value* getShadowEntryAddress(Value* Ptr) {
+        Value* P = Builder->CreatePtrToInt(Ptr, MySizeType);
+        Value* ShadowOffset = ConstantInt::get(MySizeType, ClShadowOffset);
+        Value* ShadowAddr = Builder->CreateAdd(Builder->CreateShl(Builder->CreateLShr(P, 3), 2), ShadowOffset);
+        return Builder->CreateIntToPtr(ShadowAddr, Type::getInt32PtrTy(CurrentModule->getContext()));
+    }
+
     Value* lookupMetadataTableEntry(Value* Ptr, Instruction* CurrInst) {
         if (isCurrentFunctionWhitelistedForInstrumentation) {
-            errs() << "\tSKIPPING Metadata Table lookup for " << *Ptr << " because of whitelisting\n";
-            Value* lookedupsize = ConstantInt::get(MySizeType, 10000);
-            TheState.SetSizeForPointerVariable(Ptr, lookedupsize);
-            return lookedupsize;
+            NESCHECK_LOG(Trace) << "\tSKIPPING Metadata Table lookup for " << *Ptr << " because of whitelisting\n";
+            TheState.SetSizeForPointerVariable(Ptr, WhitelistedSizeConstInt);
+            return WhitelistedSizeConstInt;
         }
 
-        errs() << "\tInjecting Metadata Table lookup for " << *Ptr << "\n";
+        if (ClShadowMemory) {
+            NESCHECK_LOG(Trace) << "\tInjecting shadow memory lookup for " << *Ptr << "\n";
+            IRBuilder<>::InsertPointGuard Guard(*Builder);
+            Builder->SetInsertPoint(CurrInst->getNextNode());
+            Value* size = Builder->CreateZExt(Builder->CreateLoad(getShadowEntryAddress(Ptr)), MySizeType);
+            ++MetadataTableLookups;
+            addCost(NesCheck::CostKind::ShadowAccess);
+
+            TheState.SetSizeForPointerVariable(Ptr, size);
+            TheState.SetHasMetadataTableEntry(Ptr);
+
+            return size;
+        }
+
+        if (ClLookupCache && metadataTableEpoch)
+            return lookupMetadataTableEntryWithCache(Ptr, CurrInst);
+
+        NESCHECK_LOG(Trace) << "\tInjecting Metadata Table lookup for " << *Ptr << "\n";
         Instruction* ptrcast = (Instruction*)Builder->CreatePtrToInt(Ptr, CurrentDL->getIntPtrType(Ptr->getType()));
         ptrcast->removeFromParent();
         ptrcast->insertAfter(CurrInst);
@@ -119,123 +358,540 @@ private:
         call->removeFromParent();
         call->insertAfter(ptrcast);
         ++MetadataTableLookups;
+        addCost(NesCheck::CostKind::MetadataLookup);
 
         TheState.SetSizeForPointerVariable(Ptr, (Value*)call);
         TheState.SetHasMetadataTableEntry(Ptr);
 
         return (Value*)call;
     }
+    // Injects a lookup behind a one-entry cache private to this site, holding the last slot looked up,
+    // its size, and the table epoch at the time of the lookup. Every change to the runtime table
+    // (setMetadataTableEntry, removals, moves) bumps metadatatableepoch, so a hit is only taken when
+    // the table has not changed since the cached lookup, and the cached size is still exact.
+    // With per-node tables, the runtime only switches to the table of a new TOS_NODE_ID (and bumps the
+    // epoch) in its next call, so a hit also needs the active table to be the one of TOS_NODE_ID.
+    // The cache is checked right before CurrInst (the GEP computing the slot), on a copy of its address,
+    // so that the GEP stays in the same block as the loads and stores using it.
+    Value* lookupMetadataTableEntryWithCache(Value* Ptr, Instruction* CurrInst) {
+        NESCHECK_LOG(Trace) << "\tInjecting cached Metadata Table lookup for " << *Ptr << "\n";
+        StructType* CacheTy = StructType::get(MySizeType, MySizeType, MySizeType, NULL); // { slot, size, epoch }
+        GlobalVariable* Cache = new GlobalVariable(*CurrentModule, CacheTy, false, GlobalValue::InternalLinkage,
+                                                   ConstantAggregateZero::get(CacheTy), "nesCheckLookupCache");
+
+        Builder->SetInsertPoint(CurrInst);
+        BasicBlock* Head = CurrInst->getParent();
+        Value* SlotAddr = Builder->Insert(CurrInst->clone(), CurrInst->getName() + ".slot");
+        Value* P = Builder->CreatePtrToInt(SlotAddr, MySizeType);
+        Value* CachedSlot = Builder->CreateLoad(Builder->CreateStructGEP(CacheTy, Cache, 0));
+        Value* CachedSize = Builder->CreateLoad(Builder->CreateStructGEP(CacheTy, Cache, 1));
+        Value* CachedEpoch = Builder->CreateLoad(Builder->CreateStructGEP(CacheTy, Cache, 2));
+        Value* Epoch = Builder->CreateLoad(metadataTableEpoch);
+        Value* Hit = Builder->CreateAnd(Builder->CreateICmpEQ(CachedSlot, P), Builder->CreateICmpEQ(CachedEpoch, Epoch));
+        if (metadataTableNode && nodeId) {
+            Value* Node = Builder->CreateIntCast(Builder->CreateLoad(nodeId), MySizeType, false);
+            Value* TableNode = Builder->CreateIntCast(Builder->CreateLoad(metadataTableNode), MySizeType, false);
+            Hit = Builder->CreateAnd(Hit, Builder->CreateICmpEQ(Node, TableNode));
+        }
+
+        TerminatorInst* MissTerm = SplitBlockAndInsertIfThen(Builder->CreateNot(Hit), CurrInst, false);
+        Builder->SetInsertPoint(MissTerm);
+        Value* LookedUpSize = Builder->CreateCall(lookupMetadataFunction, P);
+        Builder->CreateStore(P, Builder->CreateStructGEP(CacheTy, Cache, 0));
+        Builder->CreateStore(LookedUpSize, Builder->CreateStructGEP(CacheTy, Cache, 1));
+        Builder->CreateStore(Epoch, Builder->CreateStructGEP(CacheTy, Cache, 2));
+
+        PHINode* Size = PHINode::Create(MySizeType, 2, Ptr->getName() + "_size", &(CurrInst->getParent()->front()));
+        Size->addIncoming(CachedSize, Head);
+        Size->addIncoming(LookedUpSize, MissTerm->getParent());
+        ++MetadataTableLookups;
+        ++MetadataTableCachedLookups;
+        addCost(NesCheck::CostKind::CachedLookup);
+
+        // CurrInst was moved to a new block by the split, refresh the insert point
+        Builder->SetInsertPoint(CurrInst);
+
+        TheState.SetSizeForPointerVariable(Ptr, Size);
+        TheState.SetHasMetadataTableEntry(Ptr);
+
+        return Size;
+    }
+
     void setMetadataTableEntry(Value* Ptr, Value* Size, Instruction* CurrInst) {
         if (isCurrentFunctionWhitelistedForInstrumentation) {
-            errs() << "\tSKIPPING Metadata Table update for " << *Ptr << " because of whitelisting\n";
+            NESCHECK_LOG(Trace) << "\tSKIPPING Metadata Table update for " << *Ptr << " because of whitelisting\n";
             return;
         }
 
-        errs() << "\tInjecting Metadata Table update for " << *Ptr << "\n";
+        if (ClShadowMemory) {
+            NESCHECK_LOG(Trace) << "\tInjecting shadow memory update for " << *Ptr << "\n";
+            Value* Size32 = Builder->CreateIntCast(Size, Type::getInt32Ty(CurrentModule->getContext()), false);
+            Builder->CreateStore(Size32, getShadowEntryAddress(Ptr));
+            ++MetadataTableUpdates;
+            addCost(NesCheck::CostKind::ShadowAccess);
+
+            TheState.SetHasMetadataTableEntry(Ptr);
+            return;
+        }
+
+        NESCHECK_LOG(Trace) << "\tInjecting Metadata Table update for " << *Ptr << "\n";
 
         Value* P = Builder->CreatePtrToInt(Ptr, CurrentDL->getIntPtrType(Ptr->getType()));
 
         Value* addr = ConstantInt::get(MySizeType, (long)((const void*)CurrInst));
         Builder->CreateCall(setMetadataFunction, { P, Size, addr });
         ++MetadataTableUpdates;
+        addCost(NesCheck::CostKind::MetadataUpdate);
+        recordMetadataTableUpdateSite(Ptr);
 
         TheState.SetHasMetadataTableEntry(Ptr);
     }
 
 
 
+    // injects the removal of the metadata for all the pointer slots inside the block at Ptr, which is being freed.
+    // If the size of the block turns out to be unknown, dropMetadataRemovalsOfUnknownSize removes it again
+    void removeMetadataTableRange(Value* Ptr) {
+        if (isCurrentFunctionWhitelistedForInstrumentation) {
+            NESCHECK_LOG(Trace) << "\tSKIPPING Metadata Table removal for " << *Ptr << " because of whitelisting\n";
+            return;
+        }
+
+        NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(Ptr);
+        Value* Size = varinfo ? varinfo->size : UnknownSizeConstInt;
+
+        NESCHECK_LOG(Trace) << "\tInjecting Metadata Table removal for " << *Ptr << "\n";
+        Value* P = Builder->CreatePtrToInt(Ptr, MySizeType);
+        CallInst* Removal = Builder->CreateCall(removeMetadataRangeFunction, { P, Size });
+        CurrentFunctionMetadataRemovals.push_back(std::make_pair(Removal, CurrentRegion));
+        ++MetadataTableRemovals;
+        addCost(NesCheck::CostKind::MetadataRemoval);
+    }
+    // injects, right after the realloc call, the move of the metadata of the old block to the new one
+    void moveMetadataTableRange(CallInst* Realloc) {
+        if (isCurrentFunctionWhitelistedForInstrumentation) {
+            NESCHECK_LOG(Trace) << "\tSKIPPING Metadata Table move for " << *Realloc << " because of whitelisting\n";
+            return;
+        }
+
+        NESCHECK_LOG(Trace) << "\tInjecting Metadata Table move for " << *Realloc << "\n";
+        Value* OldPtr = Realloc->getArgOperand(0);
+        NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(OldPtr);
+        Value* OldSize = varinfo ? varinfo->size : UnknownSizeConstInt;
+
+        IRBuilder<>::InsertPointGuard Guard(*Builder);
+        Builder->SetInsertPoint(Realloc->getNextNode());
+        Value* NewSize = Builder->CreateIntCast(Realloc->getArgOperand(1), MySizeType, false);
+        Value* OldP = Builder->CreatePtrToInt(OldPtr, MySizeType);
+        Value* NewP = Builder->CreatePtrToInt(Realloc, MySizeType);
+        CallInst* Move = Builder->CreateCall(moveMetadataRangeFunction, { OldP, OldSize, NewP, NewSize });
+        CurrentFunctionMetadataRemovals.push_back(std::make_pair(Move, CurrentRegion));
+        ++MetadataTableRemovals;
+        addCost(NesCheck::CostKind::MetadataRemoval);
+    }
+
+    // whether Size may stand for an unknown size at run time: it is one of the UnknownSizes, or is computed
+    // from one of them (size arithmetic, casts, PHIs, selects). The sizes of the function must be complete
+    bool mayBeUnknownSize(Value* Size) {
+        SmallPtrSet<Value*, 16> Visited;
+        SmallVector<Value*, 16> WorkList;
+        WorkList.push_back(Size);
+        while (!WorkList.empty()) {
+            Value* V = WorkList.pop_back_val();
+            if (!Visited.insert(V).second) continue;
+            if (UnknownSizes.count(V)) return true;
+            if (isa<PHINode>(V) || isa<SelectInst>(V) || isa<CastInst>(V) || isa<BinaryOperator>(V) || isa<ConstantExpr>(V)) {
+                for (Value* Op : cast<User>(V)->operands())
+                    WorkList.push_back(Op);
+            }
+        }
+        return false;
+    }
+
+    /// dropMetadataRemovalsOfUnknownSize - remove the removals and moves of the metadata of blocks whose size
+    /// may be unknown, once the sizes of the function are complete: clearing (or moving) the entries of the
+    /// next UnknownSizeConstInt bytes would also hit the live objects after the block. Their entries stay
+    /// behind instead, to be overwritten by the next pointer stored at the same address
+    void dropMetadataRemovalsOfUnknownSize(Function* F) {
+        for (auto& entry : CurrentFunctionMetadataRemovals) {
+            CallInst* Call = entry.first;
+            if (!mayBeUnknownSize(Call->getArgOperand(1))) continue; // the size of the (old) block
+            NESCHECK_LOG(Trace) << "\tSKIPPING Metadata Table removal because of unknown size: " << *Call << "\n";
+            NESCHECK_REMARK("metadata-removal-skipped").at(Call).attr("callee", Call->getCalledFunction()->getName());
+            Call->eraseFromParent();
+            --MetadataTableRemovals;
+            ++MetadataTableRemovalsSkipped;
+            if (isCostModelEnabled())
+                Costs.Remove(F, NesCheck::CostKind::MetadataRemoval, CurrentFunctionLoopDepths[entry.second]);
+        }
+        CurrentFunctionMetadataRemovals.clear();
+    }
+
+    // the remaining size of the object that a constant pointer (e.g., in an initializer) refers to
+    uint64_t getConstantPointerSize(Constant* C) {
+        if (C->isNullValue()) return 0;
+        int64_t Offset = 0;
+        Value* Base = GetPointerBaseWithConstantOffset(C, Offset, *CurrentDL);
+        if (GlobalVariable* GV = dyn_cast<GlobalVariable>(Base)) {
+            uint64_t size = CurrentDL->getTypeAllocSize(GV->getType()->getElementType());
+            if (Offset >= 0 && (uint64_t)Offset <= size) return size - Offset;
+        }
+        return UnknownSizeConstInt->getZExtValue();
+    }
+
+    // whether all the uses of GV are loads and stores of its elements, through GEPs (GV, 0, i),
+    // from the functions that get instrumented
+    bool isFatPointerArrayCandidate(GlobalVariable* GV) {
+        ArrayType* ArrTy = dyn_cast<ArrayType>(GV->getType()->getElementType());
+        if (!GV->hasLocalLinkage() || !GV->hasInitializer() || !ArrTy || !needsRewritten(ArrTy->getElementType()) ||
+            ((PointerType*)ArrTy->getElementType())->getElementType()->isFunctionTy())
+            return false;
+
+        for (User* U : GV->users()) {
+            GEPOperator* GEP = dyn_cast<GEPOperator>(U);
+            if (!GEP || GEP->getPointerOperand() != GV || GEP->getNumIndices() != 2 ||
+                !isa<ConstantInt>(GEP->getOperand(1)) || !cast<ConstantInt>(GEP->getOperand(1))->isZero())
+                return false;
+            for (User* GU : GEP->users()) {
+                Instruction* I = dyn_cast<Instruction>(GU);
+                if (!I || isNesCheckLibFunction(I->getParent()->getParent())) return false;
+                if (LoadInst* LI = dyn_cast<LoadInst>(I)) {
+                    if (LI->getPointerOperand() != GEP) return false;
+                } else if (StoreInst* SI = dyn_cast<StoreInst>(I)) {
+                    if (SI->getPointerOperand() != GEP || SI->getValueOperand() == GEP) return false;
+                } else {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /// rewriteFatPointerArrays - turn each module-private array of pointers [N x T*] that is only accessed
+    /// element by element into an array of fat pointers [N x {T*, size}]. The GEPs to its elements then
+    /// point to the pointer field, and processInstruction keeps the size field up to date next to it,
+    /// instead of going through the metadata table. Runs before any analysis, on the original IR.
+    void rewriteFatPointerArrays(Module& M) {
+        std::vector<GlobalVariable*> Candidates;
+        for (GlobalVariable& GV : M.globals()) {
+            if (isFatPointerArrayCandidate(&GV))
+                Candidates.push_back(&GV);
+        }
+
+        for (GlobalVariable* GV : Candidates) {
+            ArrayType* ArrTy = cast<ArrayType>(GV->getType()->getElementType());
+            StructType* FatTy = StructType::get(ArrTy->getElementType(), MySizeType, NULL);
+            ArrayType* FatArrTy = ArrayType::get(FatTy, ArrTy->getNumElements());
+
+            Constant* Init = GV->getInitializer();
+            Constant* FatInit;
+            if (isa<ConstantAggregateZero>(Init)) {
+                FatInit = ConstantAggregateZero::get(FatArrTy);
+            } else if (isa<UndefValue>(Init)) {
+                FatInit = UndefValue::get(FatArrTy);
+            } else {
+                std::vector<Constant*> Elements;
+                for (unsigned i = 0; i < ArrTy->getNumElements(); i++) {
+                    Constant* Ptr = Init->getAggregateElement(i);
+                    Elements.push_back(ConstantStruct::get(FatTy, { Ptr, ConstantInt::get(MySizeType, getConstantPointerSize(Ptr)) }));
+                }
+                FatInit = ConstantArray::get(FatArrTy, Elements);
+            }
+
+            GlobalVariable* FatGV = new GlobalVariable(M, FatArrTy, GV->isConstant(), GV->getLinkage(), FatInit, "", GV,
+                                                       GV->getThreadLocalMode(), GV->getType()->getAddressSpace());
+            FatGV->takeName(GV);
+            FatGV->setAlignment(GV->getAlignment());
+            NESCHECK_LOG(Info) << "Storing " << FatGV->getName() << " as " << ArrTy->getNumElements() << " fat pointers\n";
+            NESCHECK_REMARK("fat-pointer-array").attr("variable", FatGV->getName()).attr("elements", (int64_t)ArrTy->getNumElements());
+            ++FatPointerArrays;
+
+            // every load and store gets its own GEP to the pointer field, also for the constant GEPs
+            std::vector<User*> GEPs(GV->user_begin(), GV->user_end());
+            for (User* GEP : GEPs) {
+                std::vector<Instruction*> Accesses;
+                for (User* U : GEP->users()) Accesses.push_back(cast<Instruction>(U));
+                for (Instruction* I : Accesses) {
+                    Value* Indices[] = { GEP->getOperand(1), GEP->getOperand(2), ConstantInt::get(Type::getInt32Ty(M.getContext()), 0) };
+                    GetElementPtrInst* FatGEP = GetElementPtrInst::CreateInBounds(FatArrTy, FatGV, Indices, GEP->getName(), I);
+                    if (Instruction* GEPInst = dyn_cast<Instruction>(GEP))
+                        FatGEP->setDebugLoc(GEPInst->getDebugLoc());
+                    I->replaceUsesOfWith(GEP, FatGEP);
+                    FatPointerSlots[FatGEP] = FatTy;
+                }
+                if (Instruction* GEPInst = dyn_cast<Instruction>(GEP))
+                    GEPInst->eraseFromParent();
+                else
+                    cast<Constant>(GEP)->destroyConstant();
+            }
+            GV->eraseFromParent();
+        }
+    }
+
+    // the address of the size field of the fat pointer whose pointer field is at Slot
+    Value* getFatPointerSizeAddress(Value* Slot, StructType* FatTy) {
+        Value* FatPtr = Builder->CreateBitCast(Slot, FatTy->getPointerTo());
+        return Builder->CreateStructGEP(FatTy, FatPtr, 1, Slot->getName() + "_sizefield");
+    }
+
+    // the fat pointer counterpart of lookupMetadataTableEntry, right after the GEP computing Slot
+    Value* loadFatPointerSize(Instruction* Slot, StructType* FatTy) {
+        NESCHECK_LOG(Trace) << "\tLoading the fat pointer size of " << *Slot << "\n";
+        IRBuilder<>::InsertPointGuard Guard(*Builder);
+        Builder->SetInsertPoint(Slot->getNextNode());
+        Value* size = Builder->CreateLoad(getFatPointerSizeAddress(Slot, FatTy), Slot->getName() + "_size");
+        ++FatPointerAccesses;
+        addCost(NesCheck::CostKind::FatPointerAccess);
+        TheState.SetSizeForPointerVariable(Slot, size);
+        return size;
+    }
+
+    // the fat pointer counterpart of setMetadataTableEntry, right before the store of the pointer
+    void storeFatPointerSize(Value* Slot, StructType* FatTy, Value* Size) {
+        NESCHECK_LOG(Trace) << "\tStoring the fat pointer size of " << *Slot << "\n";
+        Builder->CreateStore(Builder->CreateIntCast(Size, MySizeType, false), getFatPointerSizeAddress(Slot, FatTy));
+        ++FatPointerAccesses;
+        addCost(NesCheck::CostKind::FatPointerAccess);
+    }
+
+    // accounts for the table entries that an update of slot Ptr can create at runtime. A global can hold
+    // at most one entry per pointer-sized slot. Any other site has no static bound: a heap site can store
+    // into any number of objects, and a stack object gets new slots at every frame depth (and recursion).
+    // For those, the estimate assumes one entry per slot of a fixed-size alloca, and one per heap site
+    void recordMetadataTableUpdateSite(Value* Ptr) {
+        Value* Obj = GetUnderlyingObject(Ptr, *CurrentDL);
+        uint64_t objsize = 0;
+        if (GlobalVariable* GV = dyn_cast<GlobalVariable>(Obj)) {
+            objsize = CurrentDL->getTypeAllocSize(GV->getType()->getElementType());
+        } else if (AllocaInst* AI = dyn_cast<AllocaInst>(Obj)) {
+            if (ConstantInt* C = dyn_cast<ConstantInt>(AI->getArraySize()))
+                objsize = CurrentDL->getTypeAllocSize(AI->getAllocatedType()) * C->getZExtValue();
+        }
+
+        if (objsize > 0)
+            MetadataTableStaticObjects[Obj] = std::max<uint64_t>(objsize / CurrentDL->getPointerSize(), 1);
+        else
+            MetadataTableDynamicUpdateSites++;
+        if (!isa<GlobalVariable>(Obj))
+            ++MetadataTableUnboundedSites;
+    }
+
+    uint64_t getMetadataTableSizeBound() {
+        uint64_t bound = MetadataTableDynamicUpdateSites;
+        for (auto& obj : MetadataTableStaticObjects)
+            bound += obj.second;
+        return bound;
+    }
+
+    // writes the pool size for the mote runtime: a power of two keeping the load factor below 3/4
+    void writePoolSizeHeader(uint64_t bound) {
+        uint64_t poolsize = 1;
+        while (poolsize * 3 < (bound + 1) * 4) poolsize *= 2;
+
+        std::error_code EC;
+        raw_fd_ostream Out(ClPoolSizeHeader, EC, sys::fs::F_Text);
+        if (EC) {
+            NESCHECK_LOG(Error) << RED << "Unable to write " << ClPoolSizeHeader << ": " << EC.message() << NORMAL << "\n";
+            return;
+        }
+        Out << "/* Generated by nesCheck for module " << CurrentModule->getModuleIdentifier() << " */\n";
+        Out << "/* " << MetadataTableStaticObjects.size() << " static objects, " << MetadataTableDynamicUpdateSites
+            << " dynamic update sites: " << (MetadataTableUnboundedSites ? "an estimated " : "at most ") << bound << " entries */\n";
+        if (MetadataTableUnboundedSites) {
+            Out << "/* " << MetadataTableUnboundedSites << " update sites are not on globals, so the pool can overflow (the runtime then traps) */\n";
+            Out << "#define NESCHECK_METADATA_POOL_SIZE_IS_ESTIMATE 1\n";
+            NESCHECK_LOG(Error) << RED << "The metadata pool size in " << ClPoolSizeHeader << " is an estimate: "
+                                << MetadataTableUnboundedSites << " update sites are not on globals" << NORMAL << "\n";
+        }
+        Out << "#define NESCHECK_METADATA_POOL_SIZE " << poolsize << "\n";
+    }
+
     Value* getSizeForValue(Value* v) {
         Value* size = ConstantInt::get(MySizeType, 0);
         SizeOffsetEvalType SizeOffset = ObjSizeEval->compute(v);
         if (ObjSizeEval->knownSize(SizeOffset)) {
-            errs() << "\tUsing Size from ObjSizeEval = " << *(SizeOffset.first) << "\n";
+            NESCHECK_LOG(Trace) << "\tUsing Size from ObjSizeEval = " << *(SizeOffset.first) << "\n";
             size = SizeOffset.first;
         } else {
             Type* t = v->getType();
             if (!isa<Function>(v))
-                errs() << "\tUsing manual Size (ObjSizeEval failed) for " << *v << " - type:" << *t << "\n";
+                NESCHECK_LOG(Trace) << "\tUsing manual Size (ObjSizeEval failed) for " << *v << " - type:" << *t << "\n";
             else
-                errs() << "\tUsing manual Size (ObjSizeEval failed) for " << ((Function*)v)->getName() << " - type:" << *t << "\n";
+                NESCHECK_LOG(Trace) << "\tUsing manual Size (ObjSizeEval failed) for " << ((Function*)v)->getName() << " - type:" << *t << "\n";
 
             if (t->isPointerTy()) t = ((PointerType*)t)->getElementType();
             if (ArrayType* arrT = dyn_cast<ArrayType>(t)) {
-                errs() << "\t\tarray[" << arrT->getNumElements() << " x " << *(arrT->getElementType()) << "]\n";
+                NESCHECK_LOG(Trace) << "\t\tarray[" << arrT->getNumElements() << " x " << *(arrT->getElementType()) << "]\n";
                 Value* arraysize = ConstantInt::get(MySizeType, arrT->getNumElements());
                 Value* totalsize = ConstantInt::get(arraysize->getType()/*MySizeType*/, CurrentDL->getTypeAllocSize(arrT->getElementType()));
                 totalsize = Builder->CreateMul(totalsize, arraysize);
                 size = Builder->CreateIntCast(totalsize, MySizeType, false);
             } else if (isa<FunctionType>(t)) {
-                errs() << "\t\t" << *t << " is a FunctionType\n";
+                NESCHECK_LOG(Trace) << "\t\t" << *t << " is a FunctionType\n";
                 size = ConstantInt::get(MySizeType, 8); // hardcode size to pointer size (i.e., 8)
             } else if ((isa<CallInst>(v) || isa<InvokeInst>(v)) && v->getType()->isPointerTy()) {
-                errs() << "\t\t" << *t << " is a CallInst/InvokeInst returning a pointer type\n";
+                NESCHECK_LOG(Trace) << "\t\t" << *t << " is a CallInst/InvokeInst returning a pointer type\n";
                 // if this is a call to an unininstrumented function that returns a pointer, we don't have info
                 size = UnknownSizeConstInt;
             } else {
-                errs() << "\t\t" << *t << " is not a special-case type for manual sizing\n";
+                NESCHECK_LOG(Trace) << "\t\t" << *t << " is not a special-case type for manual sizing\n";
                 // last attempt at getting size (for structs)
                 if (t->isSized()) size = ConstantInt::get(MySizeType, CurrentDL->getTypeAllocSize(t));
             }
-            errs() << "\tManual Size is " << *size << "\n";
+            NESCHECK_LOG(Trace) << "\tManual Size is " << *size << "\n";
         }
 
         return size;
     }
 
+    // the size of a pointer flowing into a PHI or select: its tracked size, the size of the object a constant
+    // refers to, or the unknown size for anything that was never registered
+    Value* getSizeForOperand(Value* v) {
+        NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(v);
+        if (!varinfo && isa<Constant>(v))
+            varinfo = &TheState.SetSizeForPointerVariable(v, getSizeForValue(v));
+        return varinfo ? varinfo->size : UnknownSizeConstInt;
+    }
+
+    void propagateClassification(Value* From, Value* To) {
+        if (NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(From))
+            TheState.ClassifyPointerVariable(To, varinfo->classification);
+    }
+
+    // fills in the size PHIs created by processInstruction, once all the incoming pointers have a size. The
+    // incoming blocks are taken from the pointer PHI, which instrumentGEP kept up to date when splitting them
+    void completeSizePHIs() {
+        for (auto& entry : CurrentFunctionSizePHIs) {
+            PHINode* PN = entry.first;
+            PHINode* SizePHI = entry.second;
+            for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; ++i) {
+                Value* In = PN->getIncomingValue(i);
+                Builder->SetInsertPoint(PN->getIncomingBlock(i)->getTerminator());
+                propagateClassification(In, PN);
+                SizePHI->addIncoming(getSizeForOperand(In), PN->getIncomingBlock(i));
+            }
+        }
+        CurrentFunctionSizePHIs.clear();
+    }
+
+    SlotSizes& getSlotSizes(Instruction* Slot) {
+        std::unique_ptr<SlotSizes>& sizes = CurrentFunctionSlotSizes[Slot];
+        if (!sizes) {
+            // the slot holds its registered size from its definition on
+            NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(Slot);
+            sizes.reset(new SlotSizes());
+            sizes->Updater.Initialize(MySizeType, Slot->getName() + "_size");
+            sizes->LastBlock = Slot->getParent();
+            sizes->LastSize = varinfo ? varinfo->size : UnknownSizeConstInt;
+            sizes->Updater.AddAvailableValue(sizes->LastBlock, sizes->LastSize);
+        }
+        return *sizes;
+    }
+
+    void storeSlotSize(Instruction* Slot, Value* Size, BasicBlock* BB) {
+        SlotSizes& sizes = getSlotSizes(Slot);
+        sizes.Updater.AddAvailableValue(BB, Size);
+        sizes.LastBlock = BB;
+        sizes.LastSize = Size;
+    }
+
+    // the size held by Slot at the current instruction of BB. Within a block that already loaded or stored
+    // it, that is the same value; otherwise it comes from the dominating stores, or a PHI of them
+    Value* loadSlotSize(Instruction* Slot, BasicBlock* BB) {
+        SlotSizes& sizes = getSlotSizes(Slot);
+        if (sizes.LastBlock != BB) {
+            PHINode* Placeholder = PHINode::Create(MySizeType, 0, Slot->getName() + "_size", &BB->front());
+            CurrentFunctionSizePlaceholders.push_back(std::make_pair(Placeholder, &sizes));
+            sizes.LastBlock = BB;
+            sizes.LastSize = Placeholder;
+        }
+        return sizes.LastSize;
+    }
+
+    /// resolveSlotSizes - replace the placeholders of the sizes loaded from the slots with the sizes that
+    /// reach them, inserting the PHIs needed where different stores meet (e.g., loop headers)
+    void resolveSlotSizes() {
+        DenseMap<Value*, Value*> Replacements;
+        for (auto& entry : CurrentFunctionSizePlaceholders)
+            Replacements[entry.first] = entry.second->Updater.GetValueInMiddleOfBlock(entry.first->getParent());
+
+        // a placeholder can stand for another one, when the size of a loaded pointer is stored in a slot
+        for (auto& entry : Replacements) {
+            Value* Size = entry.second;
+            for (unsigned hops = 0; Replacements.count(Size); hops++) {
+                Size = Replacements[Size];
+                if (hops == Replacements.size()) {
+                    Size = UnknownSizeConstInt; // only stored into each other, never set
+                    break;
+                }
+            }
+            entry.second = Size;
+        }
+
+        for (auto& entry : CurrentFunctionSizePlaceholders)
+            entry.first->replaceAllUsesWith(Replacements[entry.first]);
+        for (auto& entry : CurrentFunctionSizePlaceholders)
+            entry.first->eraseFromParent();
+        TheState.ReplaceSizes(Replacements);
+        for (BoundsCheck& check : CurrentFunctionChecks) {
+            if (Replacements.count(check.Size))
+                check.Size = Replacements[check.Size];
+        }
+
+        CurrentFunctionSizePlaceholders.clear();
+        CurrentFunctionSlotSizes.clear();
+    }
+
     Value* getOffsetForGEPInst(GetElementPtrInst* GEPInstr) {
         // if ObjSizeEval can directly calculate the offset for us, let's use that
         SizeOffsetEvalType SizeOffset = ObjSizeEval->compute(GEPInstr);
         if (ObjSizeEval->knownOffset(SizeOffset)) {
-            errs() << "\tUsing Offset from ObjSizeEval = " << *(SizeOffset.second) << "\n";
+            NESCHECK_LOG(Trace) << "\tUsing Offset from ObjSizeEval = " << *(SizeOffset.second) << "\n";
             return SizeOffset.second;
         }
 
         // else, let's use the GEP functions
         APInt Off(CurrentDL->getPointerTypeSizeInBits(GEPInstr->getType()), 0);
         if (GEPInstr->accumulateConstantOffset(*CurrentDL, Off)) {
-            errs() << "\tUsing Offset from GEP.accumulateConstantOffset() = " << Off << "\n";
+            NESCHECK_LOG(Trace) << "\tUsing Offset from GEP.accumulateConstantOffset() = " << Off << "\n";
             return ConstantInt::get(MySizeType, Off);
         }
 
         // as a last resort, let's infer it manually
         uint64_t typeStoreSize = CurrentDL->getTypeStoreSize(GEPInstr->getResultElementType());
-        errs() << "\tSize of type of Ptr = " << typeStoreSize << "\n";
+        NESCHECK_LOG(Trace) << "\tSize of type of Ptr = " << typeStoreSize << "\n";
         // Note: the following indexing used to be GEPInstr->getOperand(1), but now it should be more accurate
         Value* Idx = Builder->CreateIntCast(GEPInstr->getOperand(GEPInstr->getNumIndices()), MySizeType, false);
         Value* Size = ConstantInt::get(MySizeType/*IntTy*/, typeStoreSize);
         Value* Offset = Builder->CreateMul(Idx, Size);
-        errs() << "\tUsing Offset from manual evaluation = " << *Offset << "\n";
+        NESCHECK_LOG(Trace) << "\tUsing Offset from manual evaluation = " << *Offset << "\n";
         return Offset;
     }
 
 
 
     /// getTrapBB - create a basic block that traps. All overflowing conditions
-    /// branch to this block. There's only one trap block per function.
-    BasicBlock* getTrapBB(Instruction* CurrInst) {
+    /// branch to this block. There's only one trap block per function, which
+    /// reports the site of the failed check through the shared cold runtime routine.
+    BasicBlock* getTrapBB(Function* Fn) {
         if (TrapBB != nullptr /*&& SingleTrapBB*/) {
-            errs() << "\tReusing existing TrapBB\n";
+            NESCHECK_LOG(Trace) << "\tReusing existing TrapBB\n";
             return TrapBB;
         }
 
-        errs() << "\tCreating TrapBB...";
-        Function *Fn = CurrInst->getParent()->getParent();
+        NESCHECK_LOG(Trace) << "\tCreating TrapBB...";
         IRBuilder<>::InsertPointGuard Guard(*Builder);
         TrapBB = BasicBlock::Create(Fn->getContext(), "trap", Fn);
         Builder->SetInsertPoint(TrapBB);
 
         // print info useful to locate the error
-        unsigned long ln = getLineNumberForInstruction(CurrInst);
-        Value* linenum = ConstantInt::get(MySizeType, ln);
-        Builder->CreateCall(MyPrintErrorLineFn, linenum);
-
-        llvm::Value *F = Intrinsic::getDeclaration(Fn->getParent(), Intrinsic::trap);
-        CallInst *TrapCall = Builder->CreateCall(F);
-        TrapCall->setDoesNotReturn();
-        TrapCall->setDoesNotThrow();
-        TrapCall->setDebugLoc(CurrInst->getDebugLoc());
+        TrapSitePHI = Builder->CreatePHI(MySizeType, 4, "trap.site");
+        TrapLinePHI = Builder->CreatePHI(MySizeType, 4, "trap.line");
+        CallInst *ReportCall = Builder->CreateCall(MyReportCheckFailureFn, { TrapSitePHI, TrapLinePHI });
+        ReportCall->setDoesNotReturn();
+        ReportCall->setDoesNotThrow();
         Builder->CreateUnreachable();
-        errs() << " Done.\n";
+        NESCHECK_LOG(Trace) << " Done.\n";
 
         return TrapBB;
     }
@@ -245,18 +901,20 @@ private:
 
     bool instrumentGEP(GetElementPtrInst* GEPInstr) {
         if (isCurrentFunctionWhitelisted || isCurrentFunctionWhitelistedForInstrumentation) {
-            errs() << "Skipping instrumentation of GEP because of whitelisting\n";
+            NESCHECK_LOG(Trace) << "Skipping instrumentation of GEP because of whitelisting\n";
             return false;
         }
 
-        errs() << "Instrumenting GEP: " << *GEPInstr << " (getType: " << *(GEPInstr->getType()) << " -> getResultElementType: " << *(GEPInstr->getResultElementType()) << ")\n";
+        NESCHECK_LOG(Trace) << "Instrumenting GEP: " << *GEPInstr << " (getType: " << *(GEPInstr->getType()) << " -> getResultElementType: " << *(GEPInstr->getResultElementType()) << ")\n";
 
         ++ChecksConsidered;
+        unsigned ordinal = CurrentFunctionCheckOrdinal++;
 
         // find out if we're using indices, otherwise this is not necessary
         if (!(GEPInstr->hasIndices())) { // || GEPInstr->hasAllZeroIndices()) {
             ++ChecksUnable;
-            errs() << "\tUnable, no indices\n";
+            NESCHECK_LOG(Trace) << "\tUnable, no indices\n";
+            NESCHECK_REMARK("check-unable").at(GEPInstr).attr("reason", "no indices");
             return false;
         }
 
@@ -267,15 +925,17 @@ private:
         NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(Ptr);
         if (varinfo == NULL) {
             ++ChecksUnable;
-            errs() << "\tUnable, unknown variable '" << *Ptr << "'\n";
+            NESCHECK_LOG(Trace) << "\tUnable, unknown variable '" << *Ptr << "'\n";
+            NESCHECK_REMARK("check-unable").at(GEPInstr).attr("reason", "unknown variable").attr("pointer", *Ptr);
             return false;
         } else if (varinfo->classification == NesCheck::VariableStates::Safe) {
             ++ChecksSkippedForSafe;
-            errs() << "\tSkipping, SAFE variable '" << *Ptr << "'\n";
+            NESCHECK_LOG(Trace) << "\tSkipping, SAFE variable '" << *Ptr << "'\n";
+            NESCHECK_REMARK("check-skipped").at(GEPInstr).attr("reason", "SAFE pointer").attr("pointer", *Ptr);
             return false;
         }
 
-        errs() << "\tVariable found, size = " << *(varinfo->size) << "\n";
+        NESCHECK_LOG(Trace) << "\tVariable found, size = " << *(varinfo->size) << "\n";
 
         // add instrumentation to check that index is within boundaries
         uint64_t typeStoreSize = CurrentDL->getTypeStoreSize(GEPInstr->getResultElementType());
@@ -290,7 +950,7 @@ private:
             LHS = Builder->CreateSub(varinfo->size, ConstantInt::get(IntTy, typeStoreSize));
         Value* Cmp = Builder->CreateICmpSLT(LHS, Offset);
 
-        errs() << "\tCmp (" << /* *(varinfo->size) */ *LHS << " < " << *Offset << ") : " << *Cmp << "\n";
+        NESCHECK_LOG(Trace) << "\tCmp (" << /* *(varinfo->size) */ *LHS << " < " << *Offset << ") : " << *Cmp << "\n";
 
         // now emit a branch instruction to a trap block.
         // If Cmp is non-null, perform a jump only if its value evaluates to true.
@@ -300,39 +960,523 @@ private:
         if (C) {
             if (!C->getZExtValue()) {
                 // always false, no check needed
-                errs() << "\tCheck is always false (" << C->getZExtValue() << ") -> unneeded\n";
+                NESCHECK_LOG(Trace) << "\tCheck is always false (" << C->getZExtValue() << ") -> unneeded\n";
                 ++ChecksAlwaysFalse;
-                if (!IS_NAIVE) return false;
+                NESCHECK_REMARK("check-always-false").at(GEPInstr).attr("pointer", *Ptr);
+                if (!ClNaive) return false;
             } else {
                 // always true, memory bug!
-                errs() << "\t" << RED << "Check is always true (" << C->getZExtValue() << ") -> unconditional memory bug!!" << NORMAL << "\n";
+                NESCHECK_LOG(Error) << "\t" << RED << "Check is always true (" << C->getZExtValue() << ") -> unconditional memory bug!!" << NORMAL << "\n";
                 ++ChecksAlwaysTrue;
+                NESCHECK_REMARK("check-always-true").at(GEPInstr).attr("pointer", *Ptr);
                 Cmp = nullptr; // unconditional branch
             }
         }
-        errs() << "\tinstrumented\n";
+        NESCHECK_LOG(Trace) << "\tinstrumented\n";
         ++ChecksAdded;
 
-        if (IS_DEBUGGING) {
+        unsigned siteID = registerCheckSite(GEPInstr, ordinal);
+        NESCHECK_REMARK("check-added").at(GEPInstr).attr("site", (int64_t)siteID).attr("ordinal", (int64_t)ordinal)
+            .attr("pointer", *Ptr).attr("classification", PtrTypeToString(varinfo->classification))
+            .attr("size", *(varinfo->size)).attr("offset", *Offset);
+        if (ClCountChecks)
+            incrementCheckSiteCounter(siteID);
+
+        if (ClDebugChecks) {
             Builder->CreateCall(MyPrintCheckFn);
         }
 
-        Instruction *I = Builder->GetInsertPoint();
-        BasicBlock *OldBB = I->getParent();
-        BasicBlock *Cont = OldBB->splitBasicBlock(I);
-        OldBB->getTerminator()->eraseFromParent();
-
-        BranchInst* br;
+        // if Cmp is null, the branch to the trap is unconditional
+        BranchInst* br = insertTrapBranch(Builder->GetInsertPoint(), Cmp, siteID);
         if (Cmp)
-            // static BranchInst *  Create (BasicBlock *IfTrue, BasicBlock *IfFalse, Value *Cond, BasicBlock *InsertAtEnd)
-            br = BranchInst::Create(getTrapBB(I), Cont, Cmp, OldBB);
-        else
-            // static BranchInst *  Create (BasicBlock *IfTrue, BasicBlock *InsertAtEnd)
-            br = BranchInst::Create(getTrapBB(I), OldBB);
+            CurrentFunctionChecks.push_back({ br, Ptr, varinfo->size, LHS, Offset, typeStoreSize, siteID, CurrentRegion,
+                                              CurrentFunctionLoopDepths.empty() ? 0 : CurrentFunctionLoopDepths[CurrentRegion],
+                                              NesCheck::CostKind::Check });
 
         return true;
     }
 
+    // drops a check by making its block fall through to the continuation again
+    void removeCheck(BoundsCheck& check) {
+        BranchInst* Br = check.Br;
+        BasicBlock* BB = Br->getParent();
+        BasicBlock* Cont = Br->getSuccessor(1);
+        Value* Cond = Br->getCondition();
+
+        // the site counter stays, it counts the accesses for the profile, but the check no longer runs
+        if (StoreInst* Counter = ExecutedCheckCounters.lookup(Br)) {
+            Value* Incremented = Counter->getValueOperand();
+            Counter->eraseFromParent();
+            RecursivelyDeleteTriviallyDeadInstructions(Incremented);
+            ExecutedCheckCounters.erase(Br);
+        }
+
+        Br->getSuccessor(0)->removePredecessor(BB, /*DontDeleteUselessPHIs=*/true);
+        BranchInst::Create(Cont, Br);
+        Br->eraseFromParent();
+        RecursivelyDeleteTriviallyDeadInstructions(Cond);
+        MergeBlockIntoPredecessor(Cont);
+    }
+
+    // makes the block of Before branch to the TrapBB, reporting siteID, if Fail is true (always if it is
+    // null), and continue from Before otherwise
+    BranchInst* insertTrapBranch(Instruction* Before, Value* Fail, unsigned siteID) {
+        BasicBlock* BB = Before->getParent();
+        BasicBlock* Cont = BB->splitBasicBlock(Before);
+        BB->getTerminator()->eraseFromParent();
+
+        BasicBlock* Trap = getTrapBB(BB->getParent());
+        BranchInst* Br = Fail ? BranchInst::Create(Trap, Cont, Fail, BB) : BranchInst::Create(Trap, BB);
+        TrapSitePHI->addIncoming(ConstantInt::get(MySizeType, siteID), BB);
+        TrapLinePHI->addIncoming(ConstantInt::get(MySizeType, CheckSites[siteID].line, true), BB);
+        if (Fail)
+            setTrapBranchWeights(Br, siteID);
+        if (ChecksExecuted) {
+            IRBuilder<>::InsertPointGuard Guard(*Builder);
+            Builder->SetInsertPoint(Br);
+            Value* Incremented = Builder->CreateAdd(Builder->CreateLoad(ChecksExecuted), ConstantInt::get(MySizeType, 1));
+            ExecutedCheckCounters[Br] = Builder->CreateStore(Incremented, ChecksExecuted);
+        }
+        return Br;
+    }
+
+    /// eliminateRedundantChecks - remove every check that is dominated by a check on the same pointer
+    /// and size whose end offset is at least as large: if the dominating check passed, so does this one.
+    void eliminateRedundantChecks(Function* F) {
+        if (!ClEliminateRedundantChecks || CurrentFunctionChecks.size() < 2) return;
+
+        // every getAnalysis() on F recomputes both, so don't look into them before having them all
+        DominatorTree& DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+        ScalarEvolution& SE = getAnalysis<ScalarEvolution>(*F);
+
+        auto getEnd = [&SE](const BoundsCheck& check) {
+            const SCEV* Offset = SE.getSCEV(check.Offset);
+            return SE.getAddExpr(Offset, SE.getConstant(Offset->getType(), check.AccessSize));
+        };
+
+        std::vector<BoundsCheck> Remaining;
+        std::vector<BoundsCheck> Redundant;
+        for (BoundsCheck& check : CurrentFunctionChecks) {
+            const BoundsCheck* Implying = nullptr;
+            for (BoundsCheck& other : CurrentFunctionChecks) {
+                if (&other == &check || other.Base != check.Base || other.Size != check.Size) continue;
+                if (!DT.dominates(other.Br, check.Br)) continue;
+                if (other.Offset->getType() != check.Offset->getType()) continue;
+                if (SE.isKnownPredicate(ICmpInst::ICMP_SLE, getEnd(check), getEnd(other))) {
+                    Implying = &other;
+                    break;
+                }
+            }
+            if (!Implying) {
+                Remaining.push_back(check);
+                continue;
+            }
+            NESCHECK_LOG(Trace) << "\tCheck of site " << check.siteID << " is implied by the check of site " << Implying->siteID << "\n";
+            NESCHECK_REMARK("check-redundant").in(F).attr("line", (int64_t)CheckSites[check.siteID].line)
+                .attr("site", (int64_t)check.siteID).attr("implied-by", (int64_t)Implying->siteID);
+            Redundant.push_back(check);
+        }
+
+        // dominance and the end offsets are transitive, so the checks can all go even if some of them imply others
+        for (BoundsCheck& check : Redundant) {
+            removeCheck(check);
+            ++ChecksRedundant;
+        }
+        CurrentFunctionChecks.swap(Remaining);
+    }
+
+    /// coalesceBlockChecks - merge the checks on the same pointer and size within an original basic
+    /// block into the first of them, which then checks the maximum offset. Only the later checks whose
+    /// offset is already available at the first one can be merged.
+    void coalesceBlockChecks(Function* F) {
+        if (!ClCoalesceChecks || CurrentFunctionChecks.size() < 2) return;
+
+        DominatorTree& DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+        IRBuilder<>::InsertPointGuard Guard(*Builder);
+
+        std::vector<bool> merged(CurrentFunctionChecks.size(), false);
+        std::vector<BoundsCheck> Remaining;
+        std::vector<BoundsCheck> Coalesced;
+        for (unsigned i = 0; i < CurrentFunctionChecks.size(); i++) {
+            if (merged[i]) continue;
+            BoundsCheck& first = CurrentFunctionChecks[i];
+            Builder->SetInsertPoint(first.Br);
+
+            // offsets are compared against first.Limit, so shift them by the difference in access size
+            Value* MaxOffset = first.Offset;
+            for (unsigned j = i + 1; j < CurrentFunctionChecks.size(); j++) {
+                BoundsCheck& check = CurrentFunctionChecks[j];
+                if (merged[j] || check.Region != first.Region || check.Base != first.Base || check.Size != first.Size ||
+                    check.Offset->getType() != first.Offset->getType())
+                    continue;
+                Instruction* OffsetI = dyn_cast<Instruction>(check.Offset);
+                if (OffsetI && !DT.dominates(OffsetI, first.Br)) continue;
+
+                Value* Offset = check.Offset;
+                if (check.AccessSize != first.AccessSize)
+                    Offset = Builder->CreateAdd(Offset, ConstantInt::get(Offset->getType(), check.AccessSize - first.AccessSize));
+                MaxOffset = Builder->CreateSelect(Builder->CreateICmpSGT(Offset, MaxOffset), Offset, MaxOffset);
+                merged[j] = true;
+                Coalesced.push_back(check);
+                NESCHECK_LOG(Trace) << "\tCoalescing the check of site " << check.siteID << " into the check of site " << first.siteID << "\n";
+                NESCHECK_REMARK("check-coalesced").in(F).attr("line", (int64_t)CheckSites[check.siteID].line)
+                    .attr("site", (int64_t)check.siteID).attr("into", (int64_t)first.siteID);
+            }
+
+            if (MaxOffset != first.Offset) {
+                Value* OldCond = first.Br->getCondition();
+                first.Br->setCondition(Builder->CreateICmpSLT(first.Limit, MaxOffset));
+                RecursivelyDeleteTriviallyDeadInstructions(OldCond);
+                first.Offset = MaxOffset;
+            }
+            Remaining.push_back(first);
+        }
+
+        for (BoundsCheck& check : Coalesced) {
+            removeCheck(check);
+            ++ChecksCoalesced;
+        }
+        CurrentFunctionChecks.swap(Remaining);
+    }
+
+    /// hoistLoopChecks - replace the checks of affine offsets in a loop with one check of the whole
+    /// range of offsets in the loop preheader. This needs the access to run on every iteration
+    /// (it dominates the latch), the number of iterations to be known (single exiting block), and the
+    /// offset not to wrap (nsw): a wrapping offset can go out of bounds between the first and last iteration.
+    /// The range checks take the place of the checks they replace in CurrentFunctionChecks, each with a
+    /// site of its own (reporting the line of the hottest of them), so the budgets and counters see them.
+    void hoistLoopChecks(Function* F) {
+        if (!ClHoistLoopChecks || CurrentFunctionChecks.empty()) return;
+
+        // every getAnalysis() on F recomputes all three, so don't look into them before having them all
+        DominatorTree& DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+        LoopInfo& LI = getAnalysis<LoopInfoWrapperPass>(*F).getLoopInfo();
+        ScalarEvolution& SE = getAnalysis<ScalarEvolution>(*F);
+        SCEVExpander Expander(SE, *CurrentDL, "nescheck.hoisted");
+        IRBuilder<>::InsertPointGuard Guard(*Builder);
+
+        MapVector<Loop*, std::pair<Value*, BoundsCheck>> RangeChecks; // loop -> condition to trap in its preheader, its check
+        std::vector<BoundsCheck> Remaining;
+        std::vector<BoundsCheck> Hoisted;
+
+        // with a profile, the hottest checks go first, so that the check in each preheader reports the site
+        // (and gets the branch weights) of the hottest of the checks it replaces
+        std::vector<BoundsCheck> Candidates(CurrentFunctionChecks);
+        std::stable_sort(Candidates.begin(), Candidates.end(), [this](const BoundsCheck& a, const BoundsCheck& b) {
+            return CheckSites[a.siteID].profileCount > CheckSites[b.siteID].profileCount;
+        });
+        for (BoundsCheck& check : Candidates) {
+            BasicBlock* BB = check.Br->getParent();
+            Loop* L = LI.getLoopFor(BB);
+            BasicBlock* Preheader = L ? L->getLoopPreheader() : nullptr;
+            BasicBlock* Exiting = L ? L->getExitingBlock() : nullptr;
+            BasicBlock* Latch = L ? L->getLoopLatch() : nullptr;
+            const SCEVAddRecExpr* AR = L ? dyn_cast<SCEVAddRecExpr>(SE.getSCEV(check.Offset)) : nullptr;
+            const SCEV* Limit = SE.getSCEV(check.Limit);
+            if (!Preheader || !Exiting || !Latch || !DT.dominates(BB, Latch) ||
+                !AR || AR->getLoop() != L || !AR->isAffine() || !AR->getNoWrapFlags(SCEV::FlagNSW) ||
+                !SE.isLoopInvariant(Limit, L)) {
+                Remaining.push_back(check);
+                continue;
+            }
+            const SCEV* BTC = SE.getBackedgeTakenCount(L);
+            if (isa<SCEVCouldNotCompute>(BTC)) {
+                Remaining.push_back(check);
+                continue;
+            }
+
+            // the access runs BTC + 1 times if it comes before the exit test, BTC times if it comes after it
+            const SCEV* Zero = SE.getConstant(BTC->getType(), 0);
+            const SCEV* LastIteration = BTC;
+            bool mayNotRun = false;
+            if (!DT.dominates(BB, Exiting)) {
+                if (!DT.dominates(Exiting, BB) || BTC->isZero()) {
+                    Remaining.push_back(check);
+                    continue;
+                }
+                LastIteration = SE.getMinusSCEV(BTC, SE.getConstant(BTC->getType(), 1));
+                mayNotRun = !SE.isKnownPredicate(ICmpInst::ICMP_NE, BTC, Zero);
+            }
+
+            // the offset is affine and does not wrap, so it is monotonic and its maximum is either the first or the last one
+            Instruction* InsertPt = Preheader->getTerminator();
+            Type* Ty = check.Limit->getType();
+            Value* LimitV = Expander.expandCodeFor(Limit, Ty, InsertPt);
+            Value* First = Expander.expandCodeFor(AR->getStart(), Ty, InsertPt);
+            Value* Last = Expander.expandCodeFor(AR->evaluateAtIteration(LastIteration, SE), Ty, InsertPt);
+            Builder->SetInsertPoint(InsertPt);
+            Value* Fail = Builder->CreateOr(Builder->CreateICmpSLT(LimitV, First), Builder->CreateICmpSLT(LimitV, Last));
+            if (mayNotRun) {
+                Value* Runs = Builder->CreateICmpNE(Expander.expandCodeFor(BTC, BTC->getType(), InsertPt),
+                                                    ConstantInt::get(BTC->getType(), 0));
+                Fail = Builder->CreateAnd(Runs, Fail);
+            }
+
+            BoundsCheck Range = check;
+            Range.Limit = LimitV;
+            Range.Offset = Last;
+            Range.LoopDepth = L->getLoopDepth() - 1;
+            Range.Kind = NesCheck::CostKind::RangeCheck;
+            auto inserted = RangeChecks.insert(std::make_pair(L, std::make_pair(Fail, Range)));
+            if (!inserted.second) {
+                Value*& RangeCheck = inserted.first->second.first;
+                RangeCheck = Builder->CreateOr(RangeCheck, Fail);
+            }
+            Hoisted.push_back(check);
+            int64_t count = CheckSites[check.siteID].profileCount;
+            if (count >= 0) {
+                ++ChecksHoistedProfiled;
+                HoistedProfileExecutions += count;
+            }
+            NESCHECK_LOG(Trace) << "\tHoisting check of site " << check.siteID << " to " << Preheader->getName() << ": " << *Fail << "\n";
+            NESCHECK_REMARK("check-hoisted").in(F).attr("line", (int64_t)CheckSites[check.siteID].line)
+                .attr("site", (int64_t)check.siteID).attr("loop", L->getHeader()->getName()).attr("first", *First).attr("last", *Last)
+                .attr("profile-count", count);
+        }
+        // back to the order the checks were added in
+        std::sort(Remaining.begin(), Remaining.end(), [](const BoundsCheck& a, const BoundsCheck& b) {
+            return a.siteID < b.siteID;
+        });
+
+        // change the CFG only now, when LoopInfo and the DominatorTree are no longer needed
+        for (auto& entry : RangeChecks) {
+            ConstantInt* C = dyn_cast<ConstantInt>(entry.second.first);
+            if (C && C->isZero()) continue; // the whole range is in bounds
+            BoundsCheck& Range = entry.second.second;
+            unsigned hottestSiteID = Range.siteID;
+            Instruction* InsertPt = entry.first->getLoopPreheader()->getTerminator();
+            Range.siteID = registerRangeCheckSite(hottestSiteID);
+            if (ClCountChecks) {
+                Builder->SetInsertPoint(InsertPt);
+                incrementCheckSiteCounter(Range.siteID);
+            }
+            Range.Br = insertTrapBranch(InsertPt, entry.second.first, Range.siteID);
+            if (CheckSites[Range.siteID].profileCount < 0)
+                setTrapBranchWeights(Range.Br, hottestSiteID);
+            Remaining.push_back(Range);
+            ++ChecksHoistedLoops;
+        }
+        for (BoundsCheck& check : Hoisted) {
+            removeCheck(check);
+            ++ChecksHoisted;
+        }
+        CurrentFunctionChecks.swap(Remaining);
+    }
+
+    bool isCostModelEnabled() {
+        return ClCostReport || ClBudgetBytes || ClBudgetOverhead;
+    }
+
+    // accounts for one instance of Kind added to the current function, at the current region
+    void addCost(NesCheck::CostKind Kind) {
+        if (isCostModelEnabled())
+            Costs.Add(CurrentFunction, Kind, CurrentFunctionLoopDepths[CurrentRegion]);
+    }
+
+    // sorts the checks in the order a budget drops them: the most expensive to run first, the hottest in
+    // the profile (if any) among equally expensive ones, and the last added among equally hot ones
+    void sortChecksForBudget(std::vector<BoundsCheck>& Checks) {
+        std::stable_sort(Checks.begin(), Checks.end(), [this](const BoundsCheck& a, const BoundsCheck& b) {
+            if (a.LoopDepth != b.LoopDepth) return a.LoopDepth > b.LoopDepth;
+            if (CheckSites[a.siteID].profileCount != CheckSites[b.siteID].profileCount)
+                return CheckSites[a.siteID].profileCount > CheckSites[b.siteID].profileCount;
+            return a.siteID > b.siteID;
+        });
+    }
+
+    void dropCheckForBudget(BoundsCheck& check, StringRef budget) {
+        Function* F = check.Br->getParent()->getParent();
+        CheckSite& site = CheckSites[check.siteID];
+        NESCHECK_LOG(Info) << "\tDropping the check of site " << check.siteID << " (" << site.function << ":" << site.line
+                           << ") to fit the " << budget << " budget\n";
+        NESCHECK_REMARK("check-dropped").in(F).attr("line", (int64_t)site.line).attr("site", (int64_t)check.siteID)
+            .attr("budget", budget).attr("loop-depth", (int64_t)check.LoopDepth);
+        Costs.Remove(F, check.Kind, check.LoopDepth);
+        removeCheck(check);
+        DroppedSites.push_back(check.siteID);
+        ++ChecksDroppedForBudget;
+    }
+
+    /// applyOverheadBudget - drop checks of F until the cycles that the instrumentation adds to it are
+    /// estimated to be within -nescheck-budget-overhead percent of the cycles of F itself
+    void applyOverheadBudget(Function* F) {
+        if (!ClBudgetOverhead) return;
+        const NesCheck::CostModel::FunctionCost& FC = Costs.Get(F);
+        double Limit = FC.BaseCycles * ClBudgetOverhead / 100;
+        if (FC.Added.Cycles <= Limit) return;
+
+        sortChecksForBudget(CurrentFunctionChecks);
+        unsigned dropped = 0;
+        while (dropped < CurrentFunctionChecks.size() && FC.Added.Cycles > Limit)
+            dropCheckForBudget(CurrentFunctionChecks[dropped++], "overhead");
+        CurrentFunctionChecks.erase(CurrentFunctionChecks.begin(), CurrentFunctionChecks.begin() + dropped);
+
+        if (FC.Added.Cycles > Limit)
+            NESCHECK_LOG(Error) << RED << F->getName() << " is estimated at " << format("%.1f%%", FC.Added.Cycles * 100 / FC.BaseCycles)
+                                << " overhead without any check, over the budget of " << ClBudgetOverhead << "%" << NORMAL << "\n";
+    }
+
+    /// applyCodeSizeBudget - drop checks of the whole module until the code added by the instrumentation
+    /// is estimated to fit in -nescheck-budget-bytes
+    void applyCodeSizeBudget() {
+        if (!ClBudgetBytes) return;
+        SmallPtrSet<BasicBlock*, 32> Traps;
+        if (Costs.Total().Bytes > ClBudgetBytes) {
+            sortChecksForBudget(BudgetedChecks);
+            for (BoundsCheck& check : BudgetedChecks) {
+                if (Costs.Total().Bytes <= ClBudgetBytes) break;
+                Traps.insert(check.Br->getSuccessor(0));
+                dropCheckForBudget(check, "code size");
+            }
+        }
+        BudgetedChecks.clear();
+
+        for (BasicBlock* Trap : Traps) {
+            if (pred_begin(Trap) == pred_end(Trap))
+                DeleteDeadBlock(Trap);
+        }
+        if (Costs.Total().Bytes > ClBudgetBytes)
+            NESCHECK_LOG(Error) << RED << "The instrumentation is estimated at " << (uint64_t)Costs.Total().Bytes
+                                << " bytes without any check, over the budget of " << ClBudgetBytes << NORMAL << "\n";
+    }
+
+    unsigned registerCheckSite(Instruction* I, unsigned ordinal) {
+        std::string function = I->getParent()->getParent()->getName().str();
+        CheckSites.push_back({ function, ordinal, getLineNumberForInstruction(I), getCheckProfileCount(function, ordinal) });
+        if (CheckSites.back().profileCount >= 0) ++ChecksProfiled;
+        return CheckSites.size() - 1;
+    }
+    // the site of a range check in a loop preheader, at the line of the hottest check it replaces. It comes
+    // after all the checks of the function, so their ordinals are the same with and without hoisting
+    unsigned registerRangeCheckSite(unsigned hottestSiteID) {
+        std::string function = CheckSites[hottestSiteID].function;
+        unsigned ordinal = CurrentFunctionCheckOrdinal++;
+        CheckSites.push_back({ function, ordinal, CheckSites[hottestSiteID].line, getCheckProfileCount(function, ordinal) });
+        if (CheckSites.back().profileCount >= 0) ++ChecksProfiled;
+        return CheckSites.size() - 1;
+    }
+
+    // reads the CSV profile written by the runtime: site,function,ordinal,line,count
+    void loadCheckProfile() {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(ClProfile);
+        if (std::error_code EC = Buffer.getError()) {
+            NESCHECK_LOG(Error) << RED << "Unable to read profile " << ClProfile << ": " << EC.message() << NORMAL << "\n";
+            return;
+        }
+        for (line_iterator L(**Buffer); !L.is_at_eof(); ++L) {
+            SmallVector<StringRef, 5> Fields;
+            L->split(Fields, ",");
+            unsigned ordinal;
+            uint64_t count;
+            if (Fields.size() != 5 || Fields[2].getAsInteger(10, ordinal) || Fields[4].getAsInteger(10, count))
+                continue; // header or malformed line
+            CheckProfile[std::make_pair(Fields[1].str(), ordinal)] += count;
+        }
+        NESCHECK_LOG(Info) << "Loaded profile for " << CheckProfile.size() << " checks from " << ClProfile << "\n";
+    }
+
+    int64_t getCheckProfileCount(const std::string& function, unsigned ordinal) {
+        auto entry = CheckProfile.find(std::make_pair(function, ordinal));
+        return entry != CheckProfile.end() ? (int64_t)entry->second : -1;
+    }
+
+    // tells the backend that the trap is (almost) never taken, or how rarely compared to how often the
+    // check runs when there is a profile, so that the checked path gets laid out as the fall-through
+    void setTrapBranchWeights(BranchInst* br, unsigned siteID) {
+        int64_t count = CheckSites[siteID].profileCount;
+        uint32_t weight = count > 0 ? (uint32_t)std::min<int64_t>(count, UINT32_MAX) : TrapUnlikelyWeight;
+        MDBuilder MDB(br->getContext());
+        br->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(1, std::max<uint32_t>(weight, 1)));
+    }
+
+    void printHottestChecks() {
+        std::vector<unsigned> sites;
+        uint64_t total = 0;
+        for (unsigned siteID = 0; siteID < CheckSites.size(); siteID++) {
+            if (CheckSites[siteID].profileCount <= 0) continue;
+            sites.push_back(siteID);
+            total += CheckSites[siteID].profileCount;
+        }
+        std::stable_sort(sites.begin(), sites.end(), [this](unsigned a, unsigned b) {
+            return CheckSites[a].profileCount > CheckSites[b].profileCount;
+        });
+        if (sites.size() > ClProfileReportTop) sites.resize(ClProfileReportTop);
+
+        NESCHECK_LOG(Summary) << "-->) Hottest checks in the profile (" << total << " check executions):\n";
+        for (unsigned siteID : sites) {
+            CheckSite& site = CheckSites[siteID];
+            NESCHECK_LOG(Summary) << "\t" << site.function << ":" << site.line << " (site " << siteID << ", #" << site.ordinal << ")\t"
+                   << site.profileCount << " (" << site.profileCount * 100.0 / total << "%)\n";
+        }
+    }
+
+    // injects ++counters[siteID] at the current insert point
+    void incrementCheckSiteCounter(unsigned siteID) {
+        if (!CheckSiteCounters) {
+            ArrayType* PlaceholderTy = ArrayType::get(MySizeType, 0);
+            CheckSiteCounters = new GlobalVariable(*CurrentModule, PlaceholderTy, false, GlobalValue::InternalLinkage,
+                                                   ConstantAggregateZero::get(PlaceholderTy), "nesCheckSiteCounters");
+        }
+        Constant* Idx[] = { ConstantInt::get(MySizeType, 0), ConstantInt::get(MySizeType, siteID) };
+        Constant* Counter = ConstantExpr::getInBoundsGetElementPtr(CheckSiteCounters->getType()->getElementType(), CheckSiteCounters, Idx);
+        Builder->CreateStore(Builder->CreateAdd(Builder->CreateLoad(Counter), ConstantInt::get(MySizeType, 1)), Counter);
+    }
+
+    // creates the table describing each site (so that failed checks can be reported by site ID) and the
+    // real counters array, and registers both with the runtime from a module constructor, so that the
+    // counters get dumped at exit. The mote runtime has no site table, failures only report the line there.
+    void finalizeCheckSiteCounters() {
+        if (CheckSites.empty()) return;
+
+        Function* RegisterFn = CurrentModule->getFunction("registerCheckSiteCounters");
+        if (!RegisterFn) {
+            if (CheckSiteCounters)
+                NESCHECK_LOG(Error) << RED << "registerCheckSiteCounters not found, is neschecklib linked in?" << NORMAL << "\n";
+            return;
+        }
+
+        LLVMContext& C = CurrentModule->getContext();
+        FunctionType* RegisterFTy = RegisterFn->getFunctionType();
+        Constant* CountersArg = ConstantPointerNull::get(cast<PointerType>(RegisterFTy->getParamType(0)));
+        if (CheckSiteCounters) {
+            ArrayType* CountersTy = ArrayType::get(MySizeType, CheckSites.size());
+            GlobalVariable* Counters = new GlobalVariable(*CurrentModule, CountersTy, false, GlobalValue::InternalLinkage,
+                                                          ConstantAggregateZero::get(CountersTy), "nesCheckSiteCounters");
+            CheckSiteCounters->replaceAllUsesWith(ConstantExpr::getBitCast(Counters, CheckSiteCounters->getType()));
+            CheckSiteCounters->eraseFromParent();
+            Counters->setName("nesCheckSiteCounters");
+            CountersArg = ConstantExpr::getBitCast(Counters, RegisterFTy->getParamType(0));
+        }
+
+        // struct check_site_info { const char* function; long line; long ordinal; }
+        StructType* SiteTy = StructType::get(Type::getInt8PtrTy(C), MySizeType, MySizeType, NULL);
+        std::map<std::string, Constant*> FunctionNames;
+        std::vector<Constant*> Sites;
+        for (CheckSite& site : CheckSites) {
+            Constant*& Name = FunctionNames[site.function];
+            if (!Name) {
+                Constant* Str = ConstantDataArray::getString(C, site.function);
+                GlobalVariable* GV = new GlobalVariable(*CurrentModule, Str->getType(), true, GlobalValue::PrivateLinkage,
+                                                        Str, "nesCheckSiteFunction");
+                Name = ConstantExpr::getBitCast(GV, Type::getInt8PtrTy(C));
+            }
+            Sites.push_back(ConstantStruct::get(SiteTy, Name, ConstantInt::get(MySizeType, site.line, true),
+                                                ConstantInt::get(MySizeType, site.ordinal), NULL));
+        }
+        ArrayType* SitesTy = ArrayType::get(SiteTy, Sites.size());
+        GlobalVariable* SitesTable = new GlobalVariable(*CurrentModule, SitesTy, true, GlobalValue::InternalLinkage,
+                                                        ConstantArray::get(SitesTy, Sites), "nesCheckSites");
+
+        Function* Ctor = Function::Create(FunctionType::get(Type::getVoidTy(C), false), GlobalValue::InternalLinkage,
+                                          "nesCheckRegisterCheckSites", CurrentModule);
+        IRBuilder<> CtorBuilder(BasicBlock::Create(C, "", Ctor));
+        CtorBuilder.CreateCall(RegisterFn, { CountersArg,
+                                             CtorBuilder.CreateBitCast(SitesTable, RegisterFTy->getParamType(1)),
+                                             ConstantInt::get(RegisterFTy->getParamType(2), Sites.size()) });
+        CtorBuilder.CreateRetVoid();
+        appendToGlobalCtors(*CurrentModule, Ctor, 0);
+    }
+
     long getLineNumberForInstruction(Instruction *I) {
         if (MDNode *N = (MDNode*)(I->getMetadata("dbg"))) {
             DILocation Loc(N);
@@ -344,7 +1488,7 @@ private:
 
     void printLineNumberForInstruction(Instruction *I) {
         long ln = getLineNumberForInstruction(I);
-        if (ln > -1) errs() << BLUE << ln << "]" << NORMAL;
+        if (ln > -1) NESCHECK_LOG(Trace) << BLUE << ln << "]" << NORMAL;
     }
 
     bool processInstruction(Instruction *I) {
@@ -353,15 +1497,13 @@ private:
         bool changed = false;
 
         printLineNumberForInstruction(I);
-        char address[11];
-        sprintf(address, "%p", (const void*) I);
-        errs() << BLUE << "[" << address << "] " << NORMAL;
+        NESCHECK_LOG(Trace) << BLUE << "[" << (const void*) I << "] " << NORMAL;
 
         if (AllocaInst *II = dyn_cast_or_null<AllocaInst>(I)) {
             bool isArray = II->isArrayAllocation() || II->getType()->getElementType()->isArrayTy();
-            errs() << "(+) " << *II << "\t" << DETAIL << " // {";
-            if (isArray) errs() << " array[" << *(II->getArraySize()) << "]";
-            errs() << " (" << *(II->getAllocatedType()) << ") " << "}" << "" << NORMAL << "\n";
+            NESCHECK_LOG(Trace) << "(+) " << *II << "\t" << DETAIL << " // {";
+            if (isArray) NESCHECK_LOG(Trace) << " array[" << *(II->getArraySize()) << "]";
+            NESCHECK_LOG(Trace) << " (" << *(II->getAllocatedType()) << ") " << "}" << "" << NORMAL << "\n";
 
             if (II->getAllocatedType()->isPointerTy()) {
                 TheState.RegisterVariable(II);
@@ -375,21 +1517,28 @@ private:
 
         } else if (CallInst *II = dyn_cast_or_null<CallInst>(I)) {
             if (II->getCalledFunction() != NULL && II->getCalledFunction()->getName() == "malloc" && II->getCalledFunction()->arg_size() == 1) {
-                errs() << "(M) " << *II << "\n";
+                NESCHECK_LOG(Trace) << "(M) " << *II << "\n";
                 TheState.SetSizeForPointerVariable(II, II->getArgOperand(0));
             } else if (II->getCalledFunction() != NULL && II->getCalledFunction()->getName() == "realloc" && II->getCalledFunction()->arg_size() == 2) {
-                errs() << "(M) " << *II << "\n";
+                NESCHECK_LOG(Trace) << "(M) " << *II << "\n";
+                moveMetadataTableRange(II);
                 TheState.SetSizeForPointerVariable(II, II->getArgOperand(1));
             } else if (II->getCalledFunction() != NULL && II->getCalledFunction()->getName() == "free" && II->getCalledFunction()->arg_size() == 1) {
-                errs() << "(F) " << *II << "\n";
+                NESCHECK_LOG(Trace) << "(F) " << *II << "\n";
+                removeMetadataTableRange(II->getArgOperand(0));
                 TheState.SetSizeForPointerVariable(II->getArgOperand(0), NULL);
                 // propagate new size backwards
                 Value* varr = II->getArgOperand(0);
                 while (true) {
-                    if (LoadInst* II = dyn_cast<LoadInst>(varr)) {
-                        varr = II->getPointerOperand();
-                    } else if (BitCastInst* II = dyn_cast<BitCastInst>(varr)) {
-                        varr = II->getOperand(0);
+                    if (LoadInst* LI = dyn_cast<LoadInst>(varr)) {
+                        varr = LI->getPointerOperand();
+                        // the slot now holds a freed pointer
+                        if (Instruction* Slot = dyn_cast<Instruction>(varr)) {
+                            storeSlotSize(Slot, ConstantInt::get(MySizeType, 0), II->getParent());
+                            continue;
+                        }
+                    } else if (BitCastInst* BI = dyn_cast<BitCastInst>(varr)) {
+                        varr = BI->getOperand(0);
                     } else {
                         break;
                     }
@@ -397,26 +1546,26 @@ private:
                 }
 
             } else {
-                errs() << "( ) " << *II << "\n";
+                NESCHECK_LOG(Trace) << "( ) " << *II << "\n";
                 if (II->getType()->isPointerTy())
                     TheState.SetSizeForPointerVariable(II, getSizeForValue(II));
             }
 
             // check if this instruction calls a function that has been rewritten and update it
-            if (CONTAINS(FunctionsToRemove, II->getCalledFunction())) {
-                errs() << "Call needs rewriting!\n";
+            if (RewrittenFunctions.count(II->getCalledFunction())) {
+                NESCHECK_LOG(Trace) << "Call needs rewriting!\n";
                 rewriteCallSite(II);
             }
 
 
         } else if (ReturnInst *RI = dyn_cast_or_null<ReturnInst>(I)) {
-            errs() << "(R) " << *RI << "\n";
-            if (CONTAINS(FunctionsAddedWithNewReturnType, RI->getParent()->getParent())) {
-                errs() << "Return instruction needs rewriting\n";
+            NESCHECK_LOG(Trace) << "(R) " << *RI << "\n";
+            if (FunctionsAddedWithNewReturnType.count(RI->getParent()->getParent())) {
+                NESCHECK_LOG(Trace) << "Return instruction needs rewriting\n";
                 // Don't support functions that had multiple return values
                 assert(RI->getNumOperands() < 2);
                 // return the size of the pointer being returned in the old function
-                errs() << "OLD RETURN VALUE = " << *(RI->getOperand(0)) << "\n";
+                NESCHECK_LOG(Trace) << "OLD RETURN VALUE = " << *(RI->getOperand(0)) << "\n";
                 Value* varr = RI->getOperand(0);
                 llvm::Value *CCC;
                 NesCheck::VariableInfo* varinfo;
@@ -436,7 +1585,7 @@ private:
                 Return = llvm::InsertValueInst::Create(Return, RI->getOperand(0), 0, "ret", RI);
                 // Insert the globals return value in field 1
                 Return = llvm::InsertValueInst::Create(Return, CCC, 1, "ret", RI);
-                errs() << "Return: " << *Return->getType();
+                NESCHECK_LOG(Trace) << "Return: " << *Return->getType();
 
                 // And update the return instruction
                 RI->setOperand(0, Return);
@@ -447,86 +1596,59 @@ private:
             Value* valoperand = II->getValueOperand();
             // propagate size metadata
             if (!isa<Function>(valoperand))
-                errs() << "(~) " << *II << "\t" << DETAIL << " // {" << *valoperand << " -> " << *(II->getPointerOperand()) << " }" << "" << NORMAL << "\n";
+                NESCHECK_LOG(Trace) << "(~) " << *II << "\t" << DETAIL << " // {" << *valoperand << " -> " << *(II->getPointerOperand()) << " }" << "" << NORMAL << "\n";
             else
-                errs() << "(~) " << *II << "\t" << DETAIL << " // {" << ((Function*)valoperand)->getName() << " -> " << *(II->getPointerOperand()) << " }" << "" << NORMAL << "\n";
+                NESCHECK_LOG(Trace) << "(~) " << *II << "\t" << DETAIL << " // {" << ((Function*)valoperand)->getName() << " -> " << *(II->getPointerOperand()) << " }" << "" << NORMAL << "\n";
 
             if (valoperand->getType()->isPointerTy()) {
                 NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(valoperand);
 
                 if (!varinfo && isa<Constant>(valoperand))
-                    varinfo = TheState.SetSizeForPointerVariable(valoperand, getSizeForValue(valoperand));
-
-                bool differentBasicBlock = false;
-                if (Instruction* instr = dyn_cast<Instruction>(II->getPointerOperand())) {
-                    if (II->getParent() != instr->getParent()) {
-                        differentBasicBlock = true;
-                        BasicBlock* B = instr->getParent();
-                        errs() << "\tValue " << *instr << " actually comes from a different BasicBlock\n"/* << *B << "\n"*/;
-
-                        AllocaInst* sizevaralloca;
-                        NesCheck::VariableInfo* varinfo2 = TheState.GetPointerVariableInfo(instr);
-                        if (!varinfo2->hasExplicitSizeVariable) {
-                            // create a new explicit size variable for the pointer
-                            sizevaralloca = new AllocaInst(MySizeType, instr->getName() + "_size_nesCheck", B->getTerminator());
-                            // store initial size value for explicit size variable
-                            new StoreInst(varinfo2->size, sizevaralloca, B->getTerminator());
-                            TheState.SetExplicitSizeVariableForPointerVariable(instr, sizevaralloca);
-                        } else {
-                            sizevaralloca = (AllocaInst*)(varinfo2->explicitSizeVariable);
-                        }
-                        // store new size value for explicit size variable, if this BasicBlock gets executed
-                        Builder->CreateStore(varinfo->size, sizevaralloca);
-                    }
-                }
-
-                if (!differentBasicBlock) {
-                    TheState.ClassifyPointerVariable(II->getPointerOperand(), varinfo->classification);
-                    TheState.SetSizeForPointerVariable(II->getPointerOperand(), varinfo->size);
-
-                    // checks if this StoreInst needs to store metadata in the metadata table
-                    if (valoperand->getType()->isPointerTy() && !(isa<AllocaInst>(II->getPointerOperand()))) {
-                        setMetadataTableEntry(II->getPointerOperand(), varinfo->size, I);
-                    }
-
-                }
-
+                    varinfo = &TheState.SetSizeForPointerVariable(valoperand, getSizeForValue(valoperand));
+
+                Value* slot = II->getPointerOperand();
+                TheState.ClassifyPointerVariable(slot, varinfo->classification);
+                if (Instruction* Slot = dyn_cast<Instruction>(slot))
+                    storeSlotSize(Slot, varinfo->size, II->getParent());
+                else
+                    TheState.SetSizeForPointerVariable(slot, varinfo->size);
+
+                // checks if this StoreInst needs to store metadata in the metadata table (or next to the pointer)
+                if (StructType* FatTy = FatPointerSlots.lookup(slot))
+                    storeFatPointerSize(slot, FatTy, varinfo->size);
+                else if (!isa<AllocaInst>(slot))
+                    setMetadataTableEntry(slot, varinfo->size, I);
             }
 
 
         } else if (LoadInst *II = dyn_cast_or_null<LoadInst>(I)) {
             // propagate size metadata
-            errs() << "(~) " << *II << "\n";
+            NESCHECK_LOG(Trace) << "(~) " << *II << "\n";
             if (II->getType()->isPointerTy()) {
                 Value* ptroperand = II->getPointerOperand();
                 NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(ptroperand);
 
                 if (!varinfo && isa<Constant>(ptroperand))
-                    varinfo = TheState.SetSizeForPointerVariable(ptroperand, getSizeForValue(ptroperand));
-
-                if (varinfo->hasExplicitSizeVariable && (!varinfo->instantiatedExplicitSizeVariable ||
-                        (isa<Instruction>(varinfo->size) && ((Instruction*)varinfo->size)->getParent() != II->getParent()))) {
-                    // this pointer is bound to an explicit size variable but either the LoadInst has not been created yet
-                    // or it was created for a different BasicBlock and is not reachable now, so instantiate it now
-                    LoadInst* loadsize = Builder->CreateLoad(varinfo->explicitSizeVariable);
-                    TheState.SetSizeForPointerVariable(ptroperand, loadsize);
-                    TheState.SetInstantiatedExplicitSizeVariable(ptroperand, true);
-                }
+                    varinfo = &TheState.SetSizeForPointerVariable(ptroperand, getSizeForValue(ptroperand));
+
+                Value* size = varinfo->size;
+                if (Instruction* Slot = dyn_cast<Instruction>(ptroperand))
+                    size = loadSlotSize(Slot, II->getParent());
                 TheState.ClassifyPointerVariable(II, varinfo->classification);
-                TheState.SetSizeForPointerVariable(II, varinfo->size);
+                TheState.SetSizeForPointerVariable(II, size);
             }
 
 
         } else if (GetElementPtrInst *II = dyn_cast_or_null<GetElementPtrInst>(I)) {
             Value* Ptr = II->getPointerOperand();
 
-            errs() << "(*) " << *II << "\t" << DETAIL << " // {" << *(Ptr) << " (" << *(II->getPointerOperandType()) << ") | " << *(II->getType()) << " -> " << *(II->getResultElementType()) << " }" << NORMAL << "\n";
+            NESCHECK_LOG(Trace) << "(*) " << *II << "\t" << DETAIL << " // {" << *(Ptr) << " (" << *(II->getPointerOperandType()) << ") | " << *(II->getType()) << " -> " << *(II->getResultElementType()) << " }" << NORMAL << "\n";
 
-            errs() << "\tIndices = " << (II->getNumOperands() - 1) << ": ";
-            errs() << "\t";
+            NESCHECK_LOG(Trace) << "\tIndices = " << (II->getNumOperands() - 1) << ": ";
+            NESCHECK_LOG(Trace) << "\t";
             for (unsigned int operd = 1; operd < II->getNumOperands(); operd++)
-                errs() << *(II->getOperand(operd)) << " ; ";
-            errs() << "\n";
+                NESCHECK_LOG(Trace) << *(II->getOperand(operd)) << " ; ";
+            NESCHECK_LOG(Trace) << "\n";
 
             // we're accessing the pointer at an offset != 0, classify it as SEQ
             if (!(II->hasAllZeroIndices()))
@@ -534,17 +1656,21 @@ private:
 
             // register the new variable and set size for resulting value
             TheState.RegisterVariable(II);
-            if (II->getResultElementType()->isPointerTy()) {
+            if (StructType* FatTy = FatPointerSlots.lookup(II)) {
+                // the size is right next to the pointer
+                loadFatPointerSize(II, FatTy);
+            } else if (II->getResultElementType()->isPointerTy()) {
                 // this GEP needs metadata
                 lookupMetadataTableEntry(II, I);
             } else {
                 // set size as originalPtr-offset
                 NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(Ptr);
                 Value* otherSize = varinfo->size;
-                if (!(II->hasAllZeroIndices())) {
+                // an unknown size stays unknown (and must not be folded into a known-looking constant)
+                if (!(II->hasAllZeroIndices()) && !UnknownSizes.count(otherSize)) {
                     Value* Offset = getOffsetForGEPInst(II);
                     if (varinfo->size->getType() != Offset->getType()) {
-                        errs() << RED << "!!! varinfo->size->getType() (" << *(varinfo->size->getType()) << ") != Offset->getType() (" << *(Offset->getType()) << ")\n" << NORMAL;
+                        NESCHECK_LOG(Error) << RED << "!!! varinfo->size->getType() (" << *(varinfo->size->getType()) << ") != Offset->getType() (" << *(Offset->getType()) << ")\n" << NORMAL;
                     }
                     otherSize = Builder->CreateSub(varinfo->size, Offset);
                 }
@@ -554,16 +1680,33 @@ private:
             // try to instrument this GEP if needed
             changed |= instrumentGEP(II);
 
+        } else if (PHINode *II = dyn_cast_or_null<PHINode>(I)) {
+            NESCHECK_LOG(Trace) << "(~) " << *II << "\n";
+            if (II->getType()->isPointerTy()) {
+                // the incoming pointers of back edges have no size yet, so the size PHI gets completed at the end
+                PHINode* SizePHI = PHINode::Create(MySizeType, II->getNumIncomingValues(), II->getName() + "_size", II);
+                TheState.RegisterVariable(II);
+                TheState.SetSizeForPointerVariable(II, SizePHI);
+                CurrentFunctionSizePHIs.push_back(std::make_pair(II, SizePHI));
+            }
+
+        } else if (SelectInst *II = dyn_cast_or_null<SelectInst>(I)) {
+            NESCHECK_LOG(Trace) << "(~) " << *II << "\n";
+            if (II->getType()->isPointerTy()) {
+                Value* TrueSize = getSizeForOperand(II->getTrueValue());
+                Value* FalseSize = getSizeForOperand(II->getFalseValue());
+                propagateClassification(II->getTrueValue(), II);
+                propagateClassification(II->getFalseValue(), II);
+                TheState.SetSizeForPointerVariable(II, Builder->CreateSelect(II->getCondition(), TrueSize, FalseSize));
+            }
+
         } else if (CastInst *II = dyn_cast_or_null<CastInst>(I)) {
             Type *srcT = II->getSrcTy();
             Type *dstT = II->getDestTy();
-            errs() << "(>) " << *II << "\t" << DETAIL << " // { " << *srcT << " " << countIndirections(srcT) << " into " << *dstT << " " << countIndirections(dstT) << " }" << "" << NORMAL << "\n";
+            NESCHECK_LOG(Trace) << "(>) " << *II << "\t" << DETAIL << " // { " << *srcT << " " << countIndirections(srcT) << " into " << *dstT << " " << countIndirections(dstT) << " }" << "" << NORMAL << "\n";
             if (srcT->isPointerTy()) {
                 NesCheck::VariableInfo* varinfo = TheState.GetPointerVariableInfo(II->getOperand(0));
-                Type *innerSrcT = unwrapPointer(srcT);
-                Type *innerDstT = unwrapPointer(dstT);
-                if (countIndirections(srcT) != countIndirections(dstT) ||
-                        innerSrcT->isIntegerTy() != innerDstT->isIntegerTy()) {
+                if (isIncompatiblePointerCast(II)) {
                     if (LoadInst *III = dyn_cast_or_null<LoadInst>(II->getOperand(0)))
                         TheState.ClassifyPointerVariable(III->getPointerOperand(), NesCheck::VariableStates::Dyn);
                     else if (isa<CallInst>(II->getOperand(0))) {
@@ -573,20 +1716,20 @@ private:
                         TheState.ClassifyPointerVariable(II, NesCheck::VariableStates::Dyn);
                     }
                     else
-                        errs() << "=> Ignored classification of variable since we have no operand\n";
+                        NESCHECK_LOG(Trace) << "=> Ignored classification of variable since we have no operand\n";
                 }
 
                 // propagate size metadata
                 if (varinfo) {
                     TheState.SetSizeForPointerVariable(II, varinfo->size);
                 } else {
-                    errs() << "!!! DON'T KNOW variable or doesn't have size\n";
+                    NESCHECK_LOG(Trace) << "!!! DON'T KNOW variable or doesn't have size\n";
                 }
             }
 
         } else {
-            errs() << "" << RED << "( )" << NORMAL << " " << *I;
-            errs() << "\n";
+            NESCHECK_LOG(Trace) << "" << RED << "( )" << NORMAL << " " << *I;
+            NESCHECK_LOG(Trace) << "\n";
         }
 
         return changed;
@@ -599,7 +1742,7 @@ private:
 
     bool rewriteCallSite(Instruction* Call) {
         ++FunctionCallSitesRewritten;
-        errs() << "Rewriting Call " << *Call << "\n";
+        NESCHECK_LOG(Trace) << "Rewriting Call " << *Call << "\n";
 
         // Copy the existing arguments
         std::vector<Value*> Args;
@@ -615,15 +1758,15 @@ private:
         // First, copy regular arguments
         for (unsigned i = 0, e = FTy->getNumParams(); i != e; ++i, ++AI) {
             Value* varr = AI->get();
-            errs() << "Arg: " << *varr << "\n";
+            NESCHECK_LOG(Trace) << "Arg: " << *varr << "\n";
 
-            if (needsRewritten(varr->getType())) {
+            if (needsRewritten(varr->getType()) && paramNeedsSize(calledF, i)) {
                 NesCheck::VariableInfo* varinfo;
                 while (!(varinfo = TheState.GetPointerVariableInfo(varr)) && isa<LoadInst>(varr))
                     varr = ((LoadInst*)varr)->getPointerOperand();
 
                 if (!varinfo && isa<Constant>(varr))
-                    varinfo = TheState.SetSizeForPointerVariable(varr, getSizeForValue(varr));
+                    varinfo = &TheState.SetSizeForPointerVariable(varr, getSizeForValue(varr));
                 SpecificNewArgs.push_back(varinfo->size);
             }
             Args.push_back(*AI);
@@ -638,7 +1781,7 @@ private:
 
         llvm::Instruction *NewCall;
         llvm::Instruction *Before = Call;
-        Function* NF = CurrentModule->getFunction((calledF->getName() + "_nesCheck").str());
+        Function* NF = RewrittenFunctions.lookup(calledF);
         if (llvm::InvokeInst *II = llvm::dyn_cast<llvm::InvokeInst>(Call)) {
             NewCall = llvm::InvokeInst::Create(NF, II->getNormalDest(), II->getUnwindDest(), Args, "", Before);
             llvm::cast<llvm::InvokeInst>(NewCall)->setCallingConv(II->getCallingConv());
@@ -658,19 +1801,24 @@ private:
 
         // The original function returned a pointer, so the new function returns the pointer and its size
         if (needsRewritten(Call->getType())) {
-            errs() << "Updating return values of the call\n";
+            NESCHECK_LOG(Trace) << "Updating return values of the call\n";
             // Split the values
             llvm::Value *OrigRet = llvm::ExtractValueInst::Create(NewCall, 0, "origret", Before);
             llvm::Value *NewRet = llvm::ExtractValueInst::Create(NewCall, 1, "sizeret", Before);
             // Replace all the uses of the original result
             Call->replaceAllUsesWith(OrigRet);
+            Classification.AddAlias(OrigRet, Call);
             TheState.RegisterVariable(OrigRet);
             TheState.SetSizeForPointerVariable(OrigRet, NewRet);
         } else {
             Call->replaceAllUsesWith(NewCall);
         }
 
-        errs() << "Call " << *Call << " replaced with " << *NewCall << "\n";
+        for (unsigned i = 0, e = SpecificNewArgs.size() + needsRewritten(Call->getType()); i != e; ++i)
+            addCost(NesCheck::CostKind::SizeArgument);
+
+        NESCHECK_LOG(Trace) << "Call " << *Call << " replaced with " << *NewCall << "\n";
+        NESCHECK_REMARK("call-rewritten").at(NewCall).attr("callee", *NF).attr("size-args", (int64_t)SpecificNewArgs.size());
 
         // Finally, remove the old call from the program, reducing the use-count of F
         Call->eraseFromParent();
@@ -687,6 +1835,20 @@ private:
 
         return false;
     }
+    // functions of the nesCheck runtime library (neschecklib.c), never analyzed nor instrumented
+    bool isNesCheckLibFunction(Function* F) {
+        StringRef fname = F->getName();
+        return (fname == "printCheck" || fname == "reportCheckFailure" || fname == "printFaultInjectionExecuted" ||
+                fname == "setMetadataTableEntry" || fname == "lookupMetadataTableEntry" || fname == "findMetadataTableEntry" ||
+                fname == "findMetadataTableSlot" || fname == "resizeMetadataTable" || fname == "hashMetadataTableKey" ||
+                fname == "initShadowMemory" || fname == "initMetadataTable" || fname == "removeMetadataTableSlot" ||
+                fname == "reportMetadataTableOverflow" ||
+                fname == "removeMetadataTableRange" || fname == "moveMetadataTableRange" ||
+                fname == "forEachMetadataTableEntryInRange" || fname == "removeMetadataTableEntryAt" ||
+                fname == "moveMetadataTableEntryAt" || fname == "switchMetadataTableNode" ||
+                fname == "registerCheckSiteCounters" || fname == "dumpCheckSiteCounters" ||
+                fname == "registerOpCounters" || fname == "dumpOpCounters");
+    }
     bool isWhitelistedForInstrumentation(Function* F) {
         StringRef fname = F->getName();
         std::string fnamestr = fname.str();
@@ -695,30 +1857,250 @@ private:
                 (fname.endswith("_nesCheck") && CONTAINS(WhitelistedFunctions, fname.drop_back(9))));
     }
 
+    // the CCured rules of processInstruction for the instructions of F, as constraints (only reads the IR)
+    void generateClassificationConstraints(Function* F, NesCheck::ConstraintShard& Shard) {
+        for (inst_iterator i = inst_begin(*F), e = inst_end(*F); i != e; ++i) {
+            Instruction* I = &*i;
+            if (StoreInst* II = dyn_cast<StoreInst>(I)) {
+                if (II->getValueOperand()->getType()->isPointerTy())
+                    Shard.AddFlow(II->getValueOperand(), II->getPointerOperand());
+            } else if (LoadInst* II = dyn_cast<LoadInst>(I)) {
+                if (II->getType()->isPointerTy())
+                    Shard.AddFlow(II->getPointerOperand(), II);
+            } else if (GetElementPtrInst* II = dyn_cast<GetElementPtrInst>(I)) {
+                if (!(II->hasAllZeroIndices()))
+                    Shard.AddLowerBound(II->getPointerOperand(), NesCheck::VariableStates::Seq);
+            } else if (CastInst* II = dyn_cast<CastInst>(I)) {
+                if (isIncompatiblePointerCast(II)) {
+                    Value* Op = II->getOperand(0);
+                    if (LoadInst* III = dyn_cast<LoadInst>(Op)) {
+                        Shard.AddLowerBound(III->getPointerOperand(), NesCheck::VariableStates::Dyn);
+                    } else if (isa<CallInst>(Op)) {
+                        Shard.AddLowerBound(Op, NesCheck::VariableStates::Dyn);
+                        Shard.AddLowerBound(II, NesCheck::VariableStates::Dyn);
+                    }
+                }
+            } else if (PHINode* II = dyn_cast<PHINode>(I)) {
+                if (II->getType()->isPointerTy()) {
+                    for (unsigned in = 0, e = II->getNumIncomingValues(); in != e; ++in)
+                        Shard.AddFlow(II->getIncomingValue(in), II);
+                }
+            } else if (SelectInst* II = dyn_cast<SelectInst>(I)) {
+                if (II->getType()->isPointerTy()) {
+                    Shard.AddFlow(II->getTrueValue(), II);
+                    Shard.AddFlow(II->getFalseValue(), II);
+                }
+            } else if (ReturnInst* II = dyn_cast<ReturnInst>(I)) {
+                Value* RetVal = II->getReturnValue();
+                if (RetVal && RetVal->getType()->isPointerTy())
+                    Shard.AddFlowToReturn(RetVal, F);
+            } else if (CallInst* II = dyn_cast<CallInst>(I)) {
+                Function* Callee = II->getCalledFunction();
+                if (!Callee || Callee->isDeclaration() || isNesCheckLibFunction(Callee)) continue;
+                for (Argument& A : Callee->args()) {
+                    if (A.getArgNo() < II->getNumArgOperands() && A.getType()->isPointerTy())
+                        Shard.AddFlow(II->getArgOperand(A.getArgNo()), &A);
+                }
+                if (II->getType()->isPointerTy())
+                    Shard.AddFlowFromReturn(Callee, II);
+            }
+        }
+    }
+
+    /// summarizeFunctions - compute the summary of every function that the whole-module analyses work on: its
+    /// classification constraints and which of its parameters use their size. The summaries only depend on
+    /// the IR of their own function, so they are computed in parallel, or loaded from the -nescheck-cache-dir
+    /// cache when the function has the same hash as in a previous build.
+    void summarizeFunctions(Module& M) {
+        SummarizedFunctions.clear();
+        for (Function& F : M) {
+            (void)F.arg_begin(); // builds the lazy arguments, which must not happen in the threads below
+            if (!F.isDeclaration() && !isNesCheckLibFunction(&F))
+                SummarizedFunctions.push_back(&F);
+        }
+        FunctionSummaries.clear();
+        FunctionSummaries.resize(SummarizedFunctions.size());
+
+        std::unique_ptr<NesCheck::AnalysisCache> Cache;
+        if (!ClCacheDir.empty())
+            Cache.reset(new NesCheck::AnalysisCache(ClCacheDir));
+        enum { Computed, Loaded, Uncacheable };
+        std::vector<char> Outcome(SummarizedFunctions.size(), Computed);
+        parallelFor(SummarizedFunctions.size(), [&](unsigned i) {
+            Function* F = SummarizedFunctions[i];
+            NesCheck::FunctionSummary& Summary = FunctionSummaries[i];
+            SmallString<32> Hash;
+            if (Cache) {
+                NesCheck::AnalysisCache::HashFunction(*F, Hash);
+                if (Cache->Load(*F, Hash, Summary)) {
+                    Outcome[i] = Loaded;
+                    return;
+                }
+            }
+            generateClassificationConstraints(F, Summary.Constraints);
+            Summary.Params.resize(F->arg_size());
+            for (Argument& A : F->args()) {
+                if (needsRewritten(A.getType()))
+                    summarizeParamSize(&A, Summary.Params[A.getArgNo()]);
+            }
+            if (Cache && !Cache->Store(*F, Hash, Summary))
+                Outcome[i] = Uncacheable;
+        });
+
+        if (!Cache) return;
+        for (unsigned i = 0; i < SummarizedFunctions.size(); i++) {
+            if (Outcome[i] == Loaded) {
+                ++CacheHits;
+                continue;
+            }
+            ++CacheMisses;
+            if (Outcome[i] == Uncacheable)
+                NESCHECK_LOG(Info) << "Unable to cache the analysis of " << SummarizedFunctions[i]->getName() << "\n";
+        }
+        NESCHECK_LOG(Info) << "Analysis cache " << ClCacheDir << ": " << CacheHits << " hits, " << CacheMisses << " misses\n";
+    }
+
+    /// solvePointerClassifications - classify all the pointers of the module at once, as the least fixpoint
+    /// of the CCured rules that processInstruction applies, plus the flows of the arguments into the
+    /// parameters and of the returned values into the calls. Every variable then starts from its solved
+    /// classification, which no longer depends on the order in which the instructions are visited.
+    void solvePointerClassifications() {
+        // the shards are added in the order of the functions, whichever thread (or build) generated them
+        Classification.Clear();
+        for (NesCheck::FunctionSummary& Summary : FunctionSummaries)
+            Classification.AddConstraints(Summary.Constraints);
+
+        Classification.Solve();
+        TheState.SetClassificationSolver(&Classification);
+        NESCHECK_LOG(Info) << "Solved the classification of " << Classification.GetNodeCount() << " pointers with "
+                           << Classification.GetFlowCount() << " flows (" << Classification.GetComponentCount() << " components)\n";
+    }
+
+    // whether the size of the pointer V is used by U: by a check, the metadata table, or a callee. Passing
+    // V to a parameter of a defined function only adds that parameter to the Dependencies of Param, and
+    // a GEP or a cast of V only uses its size if V or the result is not SAFE, which is up to SafeUses
+    bool isSizeUsedBy(Value* V, User* U, NesCheck::ParamSizeSummary& Param) {
+        if (LoadInst* LI = dyn_cast<LoadInst>(U)) {
+            return LI->getType()->isPointerTy(); // the loaded pointer takes the size of V
+        } else if (StoreInst* SI = dyn_cast<StoreInst>(U)) {
+            return SI->getValueOperand() == V || SI->getValueOperand()->getType()->isPointerTy();
+        } else if (isa<ICmpInst>(U)) {
+            return false;
+        } else if (CallInst* CI = dyn_cast<CallInst>(U)) {
+            Function* Callee = CI->getCalledFunction();
+            if (!Callee || CI->getCalledValue() == V || Callee->getName() == "free" || Callee->getName() == "realloc")
+                return true;
+            if (Callee->isDeclaration())
+                return false; // external functions get no sizes
+            for (unsigned i = 0, e = CI->getNumArgOperands(); i != e; ++i) {
+                if (CI->getArgOperand(i) != V) continue;
+                if (i >= Callee->arg_size()) return true;
+                Param.Dependencies.push_back(std::make_pair(CI, i));
+            }
+            return false;
+        } else if ((isa<GetElementPtrInst>(U) || isa<BitCastInst>(U)) && U->getOperand(0) == V) {
+            Param.SafeUses.push_back(cast<Instruction>(U)); // e.g., the fields of a message_t*
+            return false;
+        }
+        return true; // returns, integer casts, ...
+    }
+
+    void summarizeParamSize(Argument* A, NesCheck::ParamSizeSummary& Param) {
+        for (User* U : A->users()) {
+            // -O0 code spills the parameter to a stack slot first, so follow the loads of the slot
+            StoreInst* SI = dyn_cast<StoreInst>(U);
+            AllocaInst* Slot = (SI && SI->getValueOperand() == A) ? dyn_cast<AllocaInst>(SI->getPointerOperand()) : nullptr;
+            if (!Slot) {
+                Param.Local |= isSizeUsedBy(A, U, Param);
+                continue;
+            }
+            for (User* SU : Slot->users()) {
+                if (SU == SI) continue;
+                LoadInst* Load = dyn_cast<LoadInst>(SU);
+                if (!Load) {
+                    Param.Local = true; // the slot gets written again or escapes
+                    continue;
+                }
+                for (User* LU : Load->users())
+                    Param.Local |= isSizeUsedBy(Load, LU, Param);
+            }
+        }
+    }
+
+    /// computeParamsNeedingSize - find the pointer parameters whose size is never used by their function,
+    /// so that no size argument has to be added for them. Passing a pointer to another function only uses
+    /// its size if that parameter needs one, so this iterates to a fixpoint over the dependencies in the
+    /// function summaries, after solvePointerClassifications, which decides whether the SafeUses use it.
+    /// Functions whose address is taken keep a size for every pointer parameter.
+    void computeParamsNeedingSize() {
+        ParamsNeedingSize.clear();
+        for (Function* F : SummarizedFunctions) {
+            if (!isWhitelisted(F) && !F->hasAddressTaken())
+                ParamsNeedingSize[F].assign(F->arg_size(), false);
+        }
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (unsigned i = 0; i < SummarizedFunctions.size(); i++) {
+                auto entry = ParamsNeedingSize.find(SummarizedFunctions[i]);
+                if (entry == ParamsNeedingSize.end()) continue;
+                std::vector<bool>& needs = entry->second;
+                for (unsigned argNo = 0; argNo < needs.size(); argNo++) {
+                    if (needs[argNo]) continue;
+                    const NesCheck::ParamSizeSummary& Param = FunctionSummaries[i].Params[argNo];
+                    bool needed = Param.Local;
+                    for (const Instruction* I : Param.SafeUses) {
+                        needed = needed || Classification.GetClassification(I) != NesCheck::VariableStates::Safe
+                                        || Classification.GetClassification(I->getOperand(0)) != NesCheck::VariableStates::Safe;
+                    }
+                    for (auto& dep : Param.Dependencies)
+                        needed = needed || paramNeedsSize(dep.first->getCalledFunction(), dep.second);
+                    if (needed) {
+                        needs[argNo] = true;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    bool paramNeedsSize(Function* F, unsigned i) {
+        auto entry = ParamsNeedingSize.find(F);
+        return entry == ParamsNeedingSize.end() || entry->second[i];
+    }
+
+    // registers a pointer parameter that gets no size argument
+    void registerParamWithUnknownSize(Argument* A) {
+        TheState.RegisterVariable(A);
+        // set the size to something arbitrarily big (for now, but we should set it to the size of the parameter type)
+        TheState.SetSizeForPointerVariable(A, UnknownSizeConstInt);
+    }
+
     Function* rewriteFunctionSignature(Function* F) {
         bool needsChanged = false;
-        // TODO: no instrumentation of function is needed if the pointers parameters are SAFE in every CallSite
 
         if (isCurrentFunctionWhitelisted) {
             // simply register all the parameters as if they had been processed/rewritten
             for (Function::arg_iterator i = F->arg_begin(), e = F->arg_end(); i != e; ++i) {
-                if (needsRewritten(i->getType())) {
-                    TheState.RegisterVariable(i);
-                    // set the size to something arbitrarily big (for now, but we should set it to the size of the parameter type)
-                    TheState.SetSizeForPointerVariable(i, UnknownSizeConstInt);
-                }
+                if (needsRewritten(i->getType()))
+                    registerParamWithUnknownSize(i);
             }
 
             // skip functions used with function pointer in structs for now, cause it's a mess
-            errs() << "\n\n*********\n REWRITING SIGNATURE FOR FUNCTION: " << F->getName() << '\n';
-            errs() << "SKIPPED function rewriting because of whitelisting\n";
+            NESCHECK_LOG(Info) << "\n\n*********\n REWRITING SIGNATURE FOR FUNCTION: " << F->getName() << '\n';
+            NESCHECK_LOG(Info) << "SKIPPED function rewriting because of whitelisting\n";
+            NESCHECK_REMARK("signature-skipped").in(F).attr("reason", "whitelisted");
             return F;
         } 
 
         // check for pointer parameters and add a respective Size parameter for each
         SmallVector<Argument*, 8> newArgs;
         for (Function::arg_iterator i = F->arg_begin(), e = F->arg_end(); i != e; ++i) {
-            if (needsRewritten(i->getType())) {
+            if (needsRewritten(i->getType()) && !paramNeedsSize(F, i->getArgNo())) {
+                ++SizeParamsOmitted;
+                NESCHECK_REMARK("size-param-omitted").in(F).attr("param", i->getName());
+            } else if (needsRewritten(i->getType())) {
                 Argument* newArg = new Argument(MySizeType, i->getName() + "_size");
                 newArgs.push_back(newArg); // add argument for size of this pointer
 
@@ -727,10 +2109,16 @@ private:
         }
         needsChanged |= needsRewritten(F->getReturnType());
 
-        if (!needsChanged) return F;
+        if (!needsChanged) {
+            for (Function::arg_iterator i = F->arg_begin(), e = F->arg_end(); i != e; ++i) {
+                if (needsRewritten(i->getType()))
+                    registerParamWithUnknownSize(i);
+            }
+            return F;
+        }
 
         ++FunctionSignaturesRewritten;
-        errs() << "\n\n*********\n REWRITING SIGNATURE FOR FUNCTION: " << F->getName() << '\n';
+        NESCHECK_LOG(Info) << "\n\n*********\n REWRITING SIGNATURE FOR FUNCTION: " << F->getName() << '\n';
 
         // starts changing the signature for this function by creating a new one and moving everything over there
 
@@ -764,17 +2152,18 @@ private:
         // copy all the argument names from the old function, plus add the new ones
         for (llvm::Function::arg_iterator AI = F->arg_begin(), AE = F->arg_end(), NAI = NF->arg_begin(); AI != AE; ++AI, ++NAI) {
             NAI->takeName(AI);
-            if (needsRewritten(AI->getType())) {
+            Classification.AddAlias(NAI, AI);
+            if (needsRewritten(AI->getType()) && !paramNeedsSize(F, AI->getArgNo())) {
+                registerParamWithUnknownSize(NAI);
+            } else if (needsRewritten(AI->getType())) {
                 TheState.RegisterVariable(NAI);
                 TheState.SetSizeForPointerVariable(NAI, NNAI);
-                TheState.SetExplicitSizeVariableForPointerVariable(NAI, NNAI);
-                TheState.SetInstantiatedExplicitSizeVariable(NAI, true);
                 NNAI++;
             }
         }
         llvm::Function::arg_iterator NAI = FirstNewArgIter;
         for (Argument* newarg : newArgs) {
-            errs() << "NAI: " << *NAI << " - " << "newarg name: " << newarg->getName() << "\n";
+            NESCHECK_LOG(Trace) << "NAI: " << *NAI << " - " << "newarg name: " << newarg->getName() << "\n";
             NAI->takeName(newarg);
             NAI++;
         }
@@ -782,10 +2171,12 @@ private:
         // Splice the body of the old function right into the new function, leaving the old rotting hulk of the function empty.
         NF->getBasicBlockList().splice(NF->begin(), F->getBasicBlockList());
 
-        errs() << "New signature: " << *(NF->getFunctionType()) << "\n";
+        NESCHECK_LOG(Info) << "New signature: " << *(NF->getFunctionType()) << "\n";
+        NESCHECK_REMARK("signature-rewritten").in(F).attr("new-function", *NF)
+            .attr("size-params", (int64_t)newArgs.size()).attr("returns-size", (int64_t)needsRewritten(OldRetTy));
 
         // if we changed the return type, then we will have to pimp all return instructions
-        if (needsRewritten(OldRetTy)) FunctionsAddedWithNewReturnType.push_back(NF);
+        if (needsRewritten(OldRetTy)) FunctionsAddedWithNewReturnType.insert(NF);
 
         // Replace all uses of the old arguments with the new arguments
         for (llvm::Function::arg_iterator I = F->arg_begin(), E = F->arg_end(), NI = NF->arg_begin(); I != E; ++I, ++NI)
@@ -793,63 +2184,155 @@ private:
 
         // Mark old function as deletable
         FunctionsToRemove.push_back(F);
+        RewrittenFunctions[F] = NF;
 
         return NF;
     }
 
+    /// analyzeFunction - discover the sizes of the pointers of F and instrument it, in one serial walk. Unlike
+    /// the classification and the size parameters (see summarizeFunctions), size discovery is not split into
+    /// a read-only phase that could run on the thread pool: the sizes are IR values emitted next to what they
+    /// describe (offset arithmetic, size PHIs, metadata lookups whose result is the size), and are used by the
+    /// sizes discovered after them. Recording them instead would need a plan mirroring every case of
+    /// processInstruction, to be replayed serially anyway, since TheState, CheckSites and the cost model are
+    /// shared by all the functions.
     void analyzeFunction(Function* F) {
-        errs() << "\n\n*********\n ANALYZING FUNCTION: " << F->getName() << "\n";
+        NESCHECK_LOG(Info) << "\n\n*********\n ANALYZING FUNCTION: " << F->getName() << "\n";
         if (isCurrentFunctionWhitelisted) {
-            errs() << "\t[whitelisted]\n";
+            NESCHECK_LOG(Info) << "\t[whitelisted]\n";
         }
         if (isCurrentFunctionWhitelistedForInstrumentation) {
-            errs() << "\t[whitelisted for instrumentation]\n";
+            NESCHECK_LOG(Info) << "\t[whitelisted for instrumentation]\n";
         }
 
         TheState.RegisterFunction(F);
 
         TrapBB = nullptr;
+        TrapSitePHI = TrapLinePHI = nullptr;
+        CurrentFunctionCheckOrdinal = 0;
+        CurrentFunctionChecks.clear();
+        CurrentFunction = F;
+        CurrentFunctionLoopDepths.clear();
+
+        // visit the blocks in dominator tree order, so that the size of every operand (except for the incoming
+        // values of PHIs) is known, then the unreachable ones. Remember the original block of each instruction,
+        // since instrumentGEP splits them
+        std::vector<BasicBlock*> Blocks;
+        {
+            // every getAnalysis() on F recomputes both, so don't look into them before having them all
+            DominatorTree& DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+            LoopInfo* LI = isCostModelEnabled() ? &getAnalysis<LoopInfoWrapperPass>(*F).getLoopInfo() : nullptr;
+            SmallPtrSet<BasicBlock*, 32> Reachable;
+            for (DomTreeNode* N : depth_first(DT.getRootNode())) {
+                Blocks.push_back(N->getBlock());
+                Reachable.insert(N->getBlock());
+            }
+            for (BasicBlock& BB : *F) {
+                if (!Reachable.count(&BB)) Blocks.push_back(&BB);
+            }
 
-        std::vector<Instruction*> instructionsToAnalyze;
-        for (inst_iterator i = inst_begin(*F), e = inst_end(*F); i != e; ++i) {
-            Instruction *I = &*i;
-            instructionsToAnalyze.push_back(I);
+            for (unsigned region = 0; LI && region < Blocks.size(); region++) {
+                CurrentFunctionLoopDepths.push_back(LI->getLoopDepth(Blocks[region]));
+                Costs.AddBase(F, Blocks[region]->size(), CurrentFunctionLoopDepths.back());
+            }
+        }
+        std::vector<std::pair<Instruction*, unsigned>> instructionsToAnalyze;
+        unsigned region = 0;
+        for (BasicBlock* BB : Blocks) {
+            for (Instruction& I : *BB)
+                instructionsToAnalyze.push_back(std::make_pair(&I, region));
+            region++;
+        }
+        for (auto& entry : instructionsToAnalyze) {
+            Builder->SetInsertPoint(entry.first);
+            CurrentRegion = entry.second;
+            processInstruction(entry.first);
+        }
+        completeSizePHIs();
+        resolveSlotSizes();
+        dropMetadataRemovalsOfUnknownSize(F);
+
+        if (!ClNaive) {
+            eliminateRedundantChecks(F);
+            coalesceBlockChecks(F);
+            hoistLoopChecks(F);
         }
-        for (Instruction* I : instructionsToAnalyze) {
-            Builder->SetInsertPoint(I);
-            processInstruction(I);
+
+        if (isCostModelEnabled()) {
+            for (BoundsCheck& check : CurrentFunctionChecks)
+                Costs.Add(F, check.Kind, check.LoopDepth);
+            applyOverheadBudget(F);
+            if (ClBudgetBytes)
+                BudgetedChecks.insert(BudgetedChecks.end(), CurrentFunctionChecks.begin(), CurrentFunctionChecks.end());
         }
+
+        // all the checks might have been optimized away
+        if (TrapBB && pred_begin(TrapBB) == pred_end(TrapBB))
+            DeleteDeadBlock(TrapBB);
     }
 
 
     void printStats() {
-        errs() << "\n*********\n STATS SUMMARY: \n";
-        errs() << TheState.GetVariablesStateAsString() << "\n";
+        NESCHECK_LOG(Summary) << "\n*********\n STATS SUMMARY: \n";
+        std::string VariablesState = TheState.GetVariablesStateAsString();
+        NESCHECK_LOG(Summary) << VariablesState << "\n";
 
         NesCheckCCuredSafePtrs += TheState.GetSafePointerCount();
         NesCheckCCuredSeqPtrs += TheState.GetSeqPointerCount();
         NesCheckCCuredDynPtrs += TheState.GetDynPointerCount();
         NesCheckVariablesWithMetadataTableEntries += TheState.GetHasMetadataTableEntryCount();
 
-        errs() << "-->) Number of functions found\t\t" << NesCheckFunctionCounter << "\n";
-        errs() << "-->) Checks considered\t\t" << ChecksConsidered << "\n";
-        errs() << "-->) Checks added\t\t" <<  ChecksAdded << "\n";
-        errs() << "-->) Checks always true (memory bugs)\t\t" << ChecksAlwaysTrue << "\n";
-        errs() << "-->) Checks always false (unnecessary)\t\t" << ChecksAlwaysFalse << "\n";
-        errs() << "-->) Checks skipped (SAFE pointer)\t\t" << ChecksSkippedForSafe << "\n";
-        errs() << "-->) Bounds checks unable to add\t\t" << ChecksUnable << "\n";
-        errs() << "-->) Metadata table lookups\t\t" << MetadataTableLookups << "\n";
-        errs() << "-->) Metadata table updates\t\t" << MetadataTableUpdates << "\n";
-        errs() << "-->) Function signatures rewritten\t\t" << FunctionSignaturesRewritten << "\n";
-        errs() << "-->) Function call sites rewritten\t\t" << FunctionCallSitesRewritten << "\n\n";
-
-        errs() << "STATS;" 
+        NESCHECK_LOG(Summary) << "-->) Number of functions found\t\t" << NesCheckFunctionCounter << "\n";
+        NESCHECK_LOG(Summary) << "-->) Checks considered\t\t" << ChecksConsidered << "\n";
+        NESCHECK_LOG(Summary) << "-->) Checks added\t\t" <<  ChecksAdded << "\n";
+        NESCHECK_LOG(Summary) << "-->) Checks always true (memory bugs)\t\t" << ChecksAlwaysTrue << "\n";
+        NESCHECK_LOG(Summary) << "-->) Checks always false (unnecessary)\t\t" << ChecksAlwaysFalse << "\n";
+        NESCHECK_LOG(Summary) << "-->) Checks skipped (SAFE pointer)\t\t" << ChecksSkippedForSafe << "\n";
+        NESCHECK_LOG(Summary) << "-->) Bounds checks unable to add\t\t" << ChecksUnable << "\n";
+        NESCHECK_LOG(Summary) << "-->) Checks removed as redundant\t\t" << ChecksRedundant << "\n";
+        NESCHECK_LOG(Summary) << "-->) Checks coalesced within a block\t\t" << ChecksCoalesced << "\n";
+        NESCHECK_LOG(Summary) << "-->) Checks hoisted out of loops\t\t" << ChecksHoisted << " (into " << ChecksHoistedLoops << " loop preheaders)\n";
+        NESCHECK_LOG(Summary) << "-->) Checks dropped to fit the budget\t\t" << ChecksDroppedForBudget << "\n";
+        NESCHECK_LOG(Summary) << "-->) Metadata table lookups\t\t" << MetadataTableLookups << "\n";
+        NESCHECK_LOG(Summary) << "-->) Metadata table lookups with an inline cache\t\t" << MetadataTableCachedLookups << "\n";
+        NESCHECK_LOG(Summary) << "-->) Arrays of pointers stored as fat pointers\t\t" << FatPointerArrays << "\n";
+        NESCHECK_LOG(Summary) << "-->) Metadata table accesses replaced by fat pointer size fields\t\t" << FatPointerAccesses << "\n";
+        NESCHECK_LOG(Summary) << "-->) Metadata table updates\t\t" << MetadataTableUpdates << "\n";
+        NESCHECK_LOG(Summary) << "-->) Metadata table removals\t\t" << MetadataTableRemovals << "\n";
+        NESCHECK_LOG(Summary) << "-->) Metadata table removals and moves skipped for blocks of unknown size\t\t" << MetadataTableRemovalsSkipped << "\n";
+        NESCHECK_LOG(Summary) << "-->) " << (MetadataTableUnboundedSites ? "Estimated" : "Upper bound on") << " metadata table entries\t\t"
+               << MetadataTableSizeBound << " (" << MetadataTableUnboundedSites << " update sites without a bound)\n";
+        NESCHECK_LOG(Summary) << "-->) Function signatures rewritten\t\t" << FunctionSignaturesRewritten << "\n";
+        NESCHECK_LOG(Summary) << "-->) Pointer parameters without a size argument\t\t" << SizeParamsOmitted << "\n";
+        NESCHECK_LOG(Summary) << "-->) Function call sites rewritten\t\t" << FunctionCallSitesRewritten << "\n\n";
+        if (!CheckProfile.empty()) {
+            NESCHECK_LOG(Summary) << "-->) Checks found in the execution profile\t\t" << ChecksProfiled << "\n";
+            NESCHECK_LOG(Summary) << "-->) Hoisted checks found in the execution profile\t\t" << ChecksHoistedProfiled
+                   << " (" << HoistedProfileExecutions << " check executions moved to loop preheaders)\n";
+            printHottestChecks();
+            NESCHECK_LOG(Summary) << "\n";
+        }
+        if (isCostModelEnabled()) {
+            NESCHECK_LOG(Summary) << "-->) Estimated code size of the instrumentation\t\t" << (uint64_t)Costs.Total().Bytes << " bytes\n";
+            if (ClCostReport && NesCheck::IsLogEnabled(NesCheck::Verbosity::Summary))
+                Costs.Print(NesCheck::LogStream());
+            if (!DroppedSites.empty()) {
+                NESCHECK_LOG(Summary) << "-->) Checks dropped to fit the budget:\n";
+                for (unsigned siteID : DroppedSites) {
+                    CheckSite& site = CheckSites[siteID];
+                    NESCHECK_LOG(Summary) << "\t" << site.function << ":" << site.line << " (site " << siteID << ", #" << site.ordinal << ")\n";
+                }
+            }
+            NESCHECK_LOG(Summary) << "\n";
+        }
+
+        NESCHECK_LOG(Summary) << "STATS;" 
                << NesCheckCCuredSafePtrs << ";" << NesCheckCCuredSeqPtrs << ";" << NesCheckCCuredDynPtrs << ";"
                << NesCheckVariablesWithMetadataTableEntries << ";" 
                << ChecksConsidered << ";" << ChecksAdded << ";" << ChecksSkippedForSafe << ";" << ChecksAlwaysFalse << ";" 
                << ChecksAlwaysTrue << ";" << "0" << "\n";
 
-        errs() << "\n\n";
+        NESCHECK_LOG(Summary) << "\n\n";
     }
 
 
@@ -857,14 +2340,18 @@ private:
         bool changed = false;
 
         srand(time(NULL));
+        InitDiagnostics();
+        NesCheck::PhaseTimer TotalTimer("total");
 
-        errs() << "\n\n#############\n MODULE: " << M.getName() << '\n';
+        NESCHECK_LOG(Info) << "\n\n#############\n MODULE: " << M.getName() << '\n';
 
         CurrentModule = &M;
         CurrentDL = &(M.getDataLayout());
         MySizeType = Type::getInt64Ty(M.getContext());
         BuilderTy TheBuilder(M.getContext(), TargetFolder(*CurrentDL));
         Builder = &TheBuilder;
+        if (!ClProfile.empty())
+            loadCheckProfile();
         const TargetLibraryInfo *TLI = &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
         ObjectSizeOffsetEvaluator TheObjSizeEval(*CurrentDL, TLI, M.getContext(), /*RoundToAlign=*/true);
         ObjSizeEval = &TheObjSizeEval;
@@ -876,15 +2363,38 @@ private:
         };
 
         // get commonly used values
-        MyPrintErrorLineFn = CurrentModule->getFunction("printErrorLine");
+        MyReportCheckFailureFn = CurrentModule->getFunction("reportCheckFailure");
         MyPrintCheckFn = CurrentModule->getFunction("printCheck");
         UnknownSizeConstInt = (ConstantInt*)ConstantInt::get(MySizeType, 10000000);
+        WhitelistedSizeConstInt = (ConstantInt*)ConstantInt::get(MySizeType, 10000);
+        UnknownSizes.clear();
+        UnknownSizes.insert(UnknownSizeConstInt);
+        UnknownSizes.insert(WhitelistedSizeConstInt);
 
         TheState.SetSizeType(MySizeType);
+        if (ClFatPointers) {
+            NesCheck::PhaseTimer Timer("fat-pointers");
+            rewriteFatPointerArrays(M);
+        }
+        {
+            NesCheck::PhaseTimer Timer("summarize");
+            summarizeFunctions(M);
+        }
+        {
+            NesCheck::PhaseTimer Timer("classify");
+            solvePointerClassifications();
+        }
 
         // register the functions to manipulate the metadata table
         setMetadataFunction = CurrentModule->getFunction("setMetadataTableEntry");
         lookupMetadataFunction = CurrentModule->getFunction("lookupMetadataTableEntry");
+        removeMetadataRangeFunction = CurrentModule->getFunction("removeMetadataTableRange");
+        moveMetadataRangeFunction = CurrentModule->getFunction("moveMetadataTableRange");
+        metadataTableEpoch = CurrentModule->getGlobalVariable("metadatatableepoch");
+        ChecksExecuted = ClCountChecks ? CurrentModule->getGlobalVariable("checksexecuted") : nullptr;
+        ExecutedCheckCounters.clear();
+        metadataTableNode = CurrentModule->getGlobalVariable("metadatatablenode");
+        nodeId = CurrentModule->getGlobalVariable("TOS_NODE_ID");
 
         // register all global variables
         for (auto i = M.global_begin(), e = M.global_end(); i != e; ++i) {
@@ -895,16 +2405,20 @@ private:
             }
         }
 
+        {
+            NesCheck::PhaseTimer Timer("param-sizes");
+            computeParamsNeedingSize();
+        }
+
         // process all functions
         std::vector<Function*> FunctionsToAnalyze;
+        std::unique_ptr<NesCheck::PhaseTimer> Timer(new NesCheck::PhaseTimer("rewrite-signatures"));
         for (auto i = M.begin(), e = M.end(); i != e; ++i) {
             Function* F = &*i;
 
             // skip declarations and nesCheckLib functions
             if (F->isDeclaration()) continue;
-            StringRef fname = F->getName();
-            if (fname == "printCheck" || fname == "printErrorLine" || fname == "printFaultInjectionExecuted" ||
-                fname == "setMetadataTableEntry" || fname == "lookupMetadataTableEntry" || fname == "findMetadataTableEntry")
+            if (isNesCheckLibFunction(F))
                 continue;
 
             ++NesCheckFunctionCounter;
@@ -917,6 +2431,8 @@ private:
 
             FunctionsToAnalyze.push_back(NF);
         }
+        Timer.reset(); // ends the previous phase before the next one starts
+        Timer.reset(new NesCheck::PhaseTimer("instrument"));
         for (Function* F : FunctionsToAnalyze) {
             isCurrentFunctionWhitelisted = isWhitelisted(F);
             isCurrentFunctionWhitelistedForInstrumentation = isCurrentFunctionWhitelisted || isWhitelistedForInstrumentation(F);
@@ -924,13 +2440,18 @@ private:
             // analyze all functions and populate Instrumentation WorkList
             analyzeFunction(F);
         }
+        Timer.reset();
+        Timer.reset(new NesCheck::PhaseTimer("budget"));
+        applyCodeSizeBudget();
+        Timer.reset();
+        Timer.reset(new NesCheck::PhaseTimer("remove-old-functions"));
 
-        errs() << "\n\n*********\n REMOVING OLD FUNCTIONS\n";
+        NESCHECK_LOG(Info) << "\n\n*********\n REMOVING OLD FUNCTIONS\n";
         for (Function* F : FunctionsToRemove) {
             if (F->getNumUses() > 0) {
                 // if there are some uses left, we need to keep this function and make it call the right one (we'll lose metadata)
                 // (ideally there should never be uses left around, but let's use this workaround for now)
-                errs() << "Leftover uses of " << F->getName() << "(" << F->getNumUses() << "): \n";
+                NESCHECK_LOG(Info) << "Leftover uses of " << F->getName() << "(" << F->getNumUses() << "): \n";
                 std::vector<Instruction*> leftoveruses;
                 for (Value::user_iterator UI = F->user_begin(), E = F->user_end(); UI != E; ++UI)
                     if (Instruction *instr = dyn_cast<Instruction>(*UI)) {
@@ -939,7 +2460,7 @@ private:
 
                 for (Value* U : leftoveruses) {
                     printLineNumberForInstruction((Instruction*)U);
-                    errs() << " " << *U << "\n";
+                    NESCHECK_LOG(Info) << " " << *U << "\n";
                 }
             } else {
                 // if there are no more uses left, erase the function
@@ -947,7 +2468,23 @@ private:
             }
         }
 
+        // keyed by (the values of) the functions just removed
+        ParamsNeedingSize.clear();
+        SummarizedFunctions.clear();
+        FunctionSummaries.clear();
+        FatPointerSlots.clear();
+        Timer.reset();
+        Timer.reset(new NesCheck::PhaseTimer("finalize"));
+
+        finalizeCheckSiteCounters();
+
+        MetadataTableSizeBound = getMetadataTableSizeBound();
+        if (!ClPoolSizeHeader.empty())
+            writePoolSizeHeader(MetadataTableSizeBound);
+        Timer.reset();
+
         printStats();
+        CloseRemarksStream();
 
         return changed;
     }
@@ -956,6 +2493,9 @@ private:
 
     void getAnalysisUsage(AnalysisUsage &AU) const override {
         AU.addRequired<TargetLibraryInfoWrapperPass>();
+        AU.addRequired<DominatorTreeWrapperPass>();
+        AU.addRequired<LoopInfoWrapperPass>();
+        AU.addRequired<ScalarEvolution>();
     }
 
 };
@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""Generates a large synthetic C program to measure how the nesCheck pass scales with module size.
+
+Every function takes --params pointer parameters, stores them --stores times into a heap
+array of pointers (pointer-to-pointer stores, which go through the metadata table), indexes
+them --geps times (bounds-checked GEPs), and calls --calls functions defined before it,
+passing its pointers along (signature and call site rewriting, and the size-parameter
+fixpoint). --chain makes each function call the previous one, which is the worst case
+for the analyses that iterate over the call graph.
+
+The output is deterministic for a given set of options (and --seed).
+"""
+
+import argparse
+import random
+import sys
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--functions", type=int, default=1000, help="number of generated functions")
+    parser.add_argument("--params", type=int, default=3, help="pointer parameters per function")
+    parser.add_argument("--stores", type=int, default=4, help="pointer-to-pointer stores per function")
+    parser.add_argument("--geps", type=int, default=8, help="indexed accesses (GEPs) per function")
+    parser.add_argument("--calls", type=int, default=2, help="calls to earlier functions per function")
+    parser.add_argument("--chain", action="store_true", help="always call the immediately preceding function")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the random call graph and indices")
+    parser.add_argument("-o", "--output", default="-", help="output C file (default: stdout)")
+    return parser.parse_args()
+
+
+ELEMENTS = 16  # elements of every array passed around, so that all the generated accesses are in bounds
+
+
+def generate_function(out, rng, args, i):
+    params = ", ".join("int *p%d" % p for p in range(args.params))
+    out.write("int f%d(%s, int n) {\n" % (i, params))
+    out.write("\tint acc = 0;\n")
+    out.write("\tint **slots = malloc(%d * sizeof(int *));\n" % max(args.stores, 1))
+
+    for s in range(args.stores):
+        out.write("\tslots[%d] = p%d;\n" % (s, s % args.params))
+    for g in range(args.geps):
+        p = rng.randrange(args.params)
+        out.write("\tacc += p%d[(n + %d) %% %d];\n" % (p, rng.randrange(ELEMENTS), ELEMENTS))
+    for s in range(args.stores):
+        out.write("\tacc += slots[%d][%d];\n" % (s, rng.randrange(ELEMENTS)))
+
+    if i > 0:
+        if args.chain:
+            callees = [i - 1]
+        else:
+            callees = [rng.randrange(i) for _ in range(min(args.calls, i))]
+        out.write("\tif (n > 0) {\n")
+        for callee in callees:
+            shuffled = ", ".join("p%d" % rng.randrange(args.params) for _ in range(args.params))
+            out.write("\t\tacc += f%d(%s, n - 1);\n" % (callee, shuffled))
+        out.write("\t}\n")
+
+    out.write("\tfree(slots);\n")
+    out.write("\treturn acc;\n")
+    out.write("}\n\n")
+
+
+def generate(out, args):
+    rng = random.Random(args.seed)
+    out.write("/* generated by bench/gen_module.py %s */\n" % " ".join(sys.argv[1:]))
+    out.write("#include <stdio.h>\n#include <stdlib.h>\n\n")
+    for i in range(args.functions):
+        generate_function(out, rng, args, i)
+
+    out.write("int main(void) {\n")
+    out.write("\tint acc = 0;\n")
+    for p in range(args.params):
+        out.write("\tint *a%d = calloc(%d, sizeof(int));\n" % (p, ELEMENTS))
+    arrays = ", ".join("a%d" % p for p in range(args.params))
+    # every function once, with a small depth so that the run stays short
+    for i in range(args.functions):
+        out.write("\tacc += f%d(%s, 2);\n" % (i, arrays))
+    out.write("\tprintf(\"acc is %d\\n\", acc);\n")
+    out.write("\treturn 0;\n")
+    out.write("}\n")
+
+
+def main():
+    args = parse_args()
+    if args.functions < 1 or args.params < 1:
+        sys.exit("--functions and --params must be at least 1")
+    if args.output == "-":
+        generate(sys.stdout, args)
+    else:
+        with open(args.output, "w") as out:
+            generate(out, args)
+
+
+if __name__ == "__main__":
+    main()
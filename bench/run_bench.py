@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+"""Measures how the nesCheck pass scales with module size.
+
+For every size in --sizes, generates a module with bench/gen_module.py, links it with the
+runtime (as runtest.sh does) and runs `opt -nescheck -nescheck-time-phases` on it. It records
+the wall time and peak RSS of the whole opt process, and the wall time, user time and peak RSS
+reported by the pass for each of its phases.
+
+The results go to a CSV file (size,phase,wall_s,user_s,maxrss_kb). When --baseline is given,
+the results are compared to an earlier CSV, and the script exits with status 1 if any phase
+got slower than --tolerance, so that it can serve as a regression check.
+"""
+
+import argparse
+import csv
+import os
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sizes", default="250,500,1000,2000,4000", help="comma-separated numbers of functions")
+    parser.add_argument("--gen-opts", default="", help="extra options for gen_module.py, e.g. \"--params 5 --chain\"")
+    parser.add_argument("--nescheck-opts", default="", help="extra options for the pass")
+    parser.add_argument("--pass-lib", default=os.path.join(REPO_DIR, "../../../Debug+Asserts/lib/LLVMNesCheck.so"),
+                        help="the pass plugin (default: the in-tree build, as in runtest.sh)")
+    parser.add_argument("--clang", default="clang")
+    parser.add_argument("--llvm-link", default="llvm-link")
+    parser.add_argument("--opt", default="opt")
+    parser.add_argument("--work-dir", default=os.path.join(BENCH_DIR, "work"), help="where the modules are generated")
+    parser.add_argument("--output", default=os.path.join(BENCH_DIR, "results.csv"))
+    parser.add_argument("--baseline", help="CSV of an earlier run to compare with")
+    parser.add_argument("--tolerance", type=float, default=0.25,
+                        help="relative slowdown of a phase over the baseline reported as a regression (default: 0.25)")
+    parser.add_argument("--min-wall", type=float, default=0.05,
+                        help="phases faster than this (seconds) in the baseline are not compared (default: 0.05)")
+    return parser.parse_args()
+
+
+def run(cmd):
+    subprocess.check_call(cmd)
+
+
+def run_measured(cmd):
+    """Runs cmd, returning (wall seconds, peak RSS in KB, stderr)."""
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+    stderr = proc.stderr.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    returncode = os.WEXITSTATUS(status) if os.WIFEXITED(status) else -1
+    if returncode != 0:
+        sys.stderr.write(stderr)
+        raise subprocess.CalledProcessError(returncode, cmd)
+    return wall, usage.ru_maxrss, stderr
+
+
+def parse_phases(stderr):
+    """The nescheck-phase lines printed by -nescheck-time-phases."""
+    phases = []
+    for line in stderr.splitlines():
+        fields = line.split()
+        if len(fields) == 8 and fields[0] == "nescheck-phase":
+            phases.append((fields[1], float(fields[3]), float(fields[5]), int(fields[7])))
+    return phases
+
+
+def bench_size(args, size, runtime_bc):
+    source = os.path.join(args.work_dir, "bench%d.c" % size)
+    bitcode = os.path.join(args.work_dir, "bench%d.bc" % size)
+    linked = os.path.join(args.work_dir, "bench%d.linked.bc" % size)
+
+    run([sys.executable, os.path.join(BENCH_DIR, "gen_module.py"), "--functions", str(size), "-o", source]
+        + args.gen_opts.split())
+    run([args.clang, "-O0", "-emit-llvm", "-c", source, "-o", bitcode])
+    run([args.llvm_link, runtime_bc, bitcode, "-o", linked])
+
+    cmd = [args.opt, "-load", args.pass_lib, "-nescheck", "-nescheck-verbosity=0", "-nescheck-time-phases"]
+    cmd += args.nescheck_opts.split() + ["-o", os.devnull, linked]
+    wall, maxrss, stderr = run_measured(cmd)
+
+    rows = [(size, "opt", wall, None, maxrss)]
+    rows += [(size, name, phase_wall, user, rss) for (name, phase_wall, user, rss) in parse_phases(stderr)]
+    return rows
+
+
+def load_baseline(path):
+    baseline = {}
+    with open(path) as f:
+        for row in csv.DictReader(f):
+            baseline[(int(row["size"]), row["phase"])] = float(row["wall_s"])
+    return baseline
+
+
+def main():
+    args = parse_args()
+    os.makedirs(args.work_dir, exist_ok=True)
+
+    runtime_bc = os.path.join(args.work_dir, "neschecklib.bc")
+    run([args.clang, "-O0", "-emit-llvm", "-c", os.path.join(REPO_DIR, "neschecklib.c"), "-o", runtime_bc])
+
+    rows = []
+    for size in [int(s) for s in args.sizes.split(",")]:
+        size_rows = bench_size(args, size, runtime_bc)
+        rows += size_rows
+        print("%6d functions: %8.3fs, %8d KB peak RSS" % (size, size_rows[0][2], size_rows[0][4]))
+        for (_, phase, wall, _, rss) in size_rows[1:]:
+            print("    %-22s %8.3fs %8d KB" % (phase, wall, rss))
+
+    with open(args.output, "w", newline="") as f:
+        writer = csv.writer(f)
+        writer.writerow(["size", "phase", "wall_s", "user_s", "maxrss_kb"])
+        for (size, phase, wall, user, rss) in rows:
+            writer.writerow([size, phase, "%.6f" % wall, "" if user is None else "%.6f" % user, rss])
+    print("results written to %s" % args.output)
+
+    if not args.baseline:
+        return
+    baseline = load_baseline(args.baseline)
+    regressions = 0
+    for (size, phase, wall, _, _) in rows:
+        before = baseline.get((size, phase))
+        if before is None or before < args.min_wall:
+            continue
+        if wall > before * (1 + args.tolerance):
+            print("REGRESSION %d functions, %s: %.3fs -> %.3fs (%+.0f%%)" % (size, phase, before, wall, (wall / before - 1) * 100))
+            regressions += 1
+    if regressions:
+        sys.exit(1)
+    print("no regressions over %s" % args.baseline)
+
+
+if __name__ == "__main__":
+    main()
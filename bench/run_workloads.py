@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""Measures the runtime overhead of the nesCheck instrumentation on the programs in bench/workloads.
+
+Every workload is built in three variants, through the same pipeline as runtest.sh:
+  native    - not instrumented
+  naive     - opt -nescheck -nescheck-naive (every check kept, no check optimizations)
+  optimized - opt -nescheck with the default optimizations (plus --optimized-opts)
+For each variant it reports the execution time (the best of --repeat runs), the code size (the
+text segment of the binary) and, from a second build with -nescheck-count-checks and a runtime
+built with -DNESCHECK_COUNT_OPS, the number of checks executed and of metadata table operations.
+The instrumented variants must print the same output as the native one.
+
+The results go to a CSV file (workload,variant,time_s,slowdown,text_bytes,text_growth,checks,
+lookups,updates,removals,moves).
+"""
+
+import argparse
+import csv
+import glob
+import os
+import subprocess
+import sys
+import time
+
+from run_bench import BENCH_DIR, REPO_DIR, run
+
+VARIANTS = ["native", "naive", "optimized"]
+OPS = ["checks", "lookups", "updates", "removals", "moves"]
+PIPELINES = {
+    "o0": ([], []),
+    "ssa": (["-mem2reg", "-sroa"], ["-instcombine", "-simplifycfg", "-gvn", "-instcombine", "-simplifycfg"]),
+}
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("workloads", nargs="*", help="C files (default: bench/workloads/*.c)")
+    parser.add_argument("--iterations", type=int, default=20000, help="passed to every workload as argv[1]")
+    parser.add_argument("--repeat", type=int, default=3, help="timed runs per variant, the fastest is reported")
+    parser.add_argument("--pipeline", choices=sorted(PIPELINES), default="o0", help="as NESCHECK_PIPELINE in runtest.sh")
+    parser.add_argument("--nescheck-opts", default="", help="extra options for the pass, in both instrumented variants")
+    parser.add_argument("--optimized-opts", default="", help="extra options for the pass in the optimized variant, "
+                        "e.g. \"-nescheck-hoist-loop-checks -nescheck-lookup-cache\"")
+    parser.add_argument("--runtime-cflags", default="", help="extra flags for the runtime, as RUNTIME_CFLAGS in runtest.sh")
+    parser.add_argument("--pass-lib", default=os.path.join(REPO_DIR, "../../../Debug+Asserts/lib/LLVMNesCheck.so"),
+                        help="the pass plugin (default: the in-tree build, as in runtest.sh)")
+    parser.add_argument("--clang", default="clang")
+    parser.add_argument("--llvm-link", default="llvm-link")
+    parser.add_argument("--opt", default="opt")
+    parser.add_argument("--llc", default="llc")
+    parser.add_argument("--cc", default="gcc", help="assembles and links the binaries, as in runtest.sh")
+    parser.add_argument("--size", default="size")
+    parser.add_argument("--work-dir", default=os.path.join(BENCH_DIR, "work"), help="where the variants are built")
+    parser.add_argument("--output", default=os.path.join(BENCH_DIR, "workloads.csv"))
+    return parser.parse_args()
+
+
+def build_runtime(args, name, cflags):
+    bitcode = os.path.join(args.work_dir, name + ".bc")
+    run([args.clang, "-O0", "-emit-llvm", "-c", os.path.join(REPO_DIR, "neschecklib.c"), "-o", bitcode]
+        + args.runtime_cflags.split() + cflags)
+    return bitcode
+
+
+def build_variant(args, bitcode, runtime_bc, variant, counting):
+    """Builds one variant of the workload in bitcode, returning the path of the binary."""
+    base = os.path.splitext(bitcode)[0] + "." + variant + (".count" if counting else "")
+    pre, post = PIPELINES[args.pipeline]
+    cmd = [args.opt, "-o", base + ".opt.bc"] + pre
+    if variant == "native":
+        cmd += post + [bitcode]
+    else:
+        run([args.llvm_link, runtime_bc, bitcode, "-o", base + ".linked.bc"])
+        cmd[1:1] = ["-load", args.pass_lib]
+        cmd += ["-nescheck", "-nescheck-verbosity=0"] + post + args.nescheck_opts.split()
+        if variant == "naive":
+            cmd.append("-nescheck-naive")
+        else:
+            cmd += args.optimized_opts.split()
+        if counting:
+            cmd.append("-nescheck-count-checks")
+        cmd.append(base + ".linked.bc")
+    run(cmd)
+    run([args.llc, base + ".opt.bc", "-o", base + ".s"])
+    run([args.cc, base + ".s", "-o", base + ".native"])
+    return base + ".native"
+
+
+def run_binary(args, binary):
+    """Runs the binary, returning (wall seconds, stdout, stderr)."""
+    env = dict(os.environ, NESCHECK_PROFILE=binary + ".profile.csv")
+    start = time.monotonic()
+    proc = subprocess.run([binary, str(args.iterations)], stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True, env=env)
+    wall = time.monotonic() - start
+    if proc.returncode != 0:
+        sys.stderr.write(proc.stdout + proc.stderr)
+        raise subprocess.CalledProcessError(proc.returncode, binary)
+    return wall, proc.stdout, proc.stderr
+
+
+def parse_ops(stderr):
+    """The nescheck-ops line printed at exit by a runtime built with -DNESCHECK_COUNT_OPS."""
+    for line in stderr.splitlines():
+        fields = line.split()
+        if fields and fields[0] == "nescheck-ops":
+            return dict(zip(fields[1::2], (int(count) for count in fields[2::2])))
+    return {}
+
+
+def text_size(args, binary):
+    # Berkeley format: text data bss dec hex filename
+    lines = subprocess.check_output([args.size, binary], universal_newlines=True).splitlines()
+    return int(lines[1].split()[0])
+
+
+def bench_workload(args, source, runtimes):
+    name = os.path.splitext(os.path.basename(source))[0]
+    bitcode = os.path.join(args.work_dir, name + ".bc")
+    run([args.clang, "-O0", "-emit-llvm", "-c", source, "-o", bitcode])
+
+    rows = []
+    expected = None
+    for variant in VARIANTS:
+        binary = build_variant(args, bitcode, runtimes[False], variant, counting=False)
+        times = []
+        for _ in range(args.repeat):
+            wall, stdout, _ = run_binary(args, binary)
+            times.append(wall)
+        if expected is None:
+            expected = stdout
+        elif stdout != expected:
+            sys.exit("%s: the %s variant printed\n%s\ninstead of\n%s" % (name, variant, stdout, expected))
+
+        ops = {}
+        if variant != "native":
+            _, _, stderr = run_binary(args, build_variant(args, bitcode, runtimes[True], variant, counting=True))
+            ops = parse_ops(stderr)
+        rows.append({"workload": name, "variant": variant, "time_s": min(times), "text_bytes": text_size(args, binary),
+                     **{op: ops.get(op, 0) for op in OPS}})
+
+    native = rows[0]
+    for row in rows:
+        row["slowdown"] = row["time_s"] / native["time_s"] if native["time_s"] > 0 else 0.0
+        row["text_growth"] = row["text_bytes"] / native["text_bytes"] - 1
+    return rows
+
+
+def main():
+    args = parse_args()
+    sources = args.workloads or sorted(glob.glob(os.path.join(BENCH_DIR, "workloads", "*.c")))
+    os.makedirs(args.work_dir, exist_ok=True)
+    runtimes = {
+        False: build_runtime(args, "neschecklib", []),
+        True: build_runtime(args, "neschecklib.count", ["-DNESCHECK_COUNT_OPS"]),
+    }
+
+    rows = []
+    print("%-14s %-10s %9s %8s %10s %7s %12s %12s %10s %9s %7s" % (
+        "workload", "variant", "time", "slowdown", "text", "growth", "checks", "lookups", "updates", "removals", "moves"))
+    for source in sources:
+        for row in bench_workload(args, source, runtimes):
+            rows.append(row)
+            print("%-14s %-10s %8.3fs %7.2fx %10d %+6.1f%% %12d %12d %10d %9d %7d" % (
+                row["workload"], row["variant"], row["time_s"], row["slowdown"], row["text_bytes"],
+                row["text_growth"] * 100, row["checks"], row["lookups"], row["updates"], row["removals"], row["moves"]))
+
+    fields = ["workload", "variant", "time_s", "slowdown", "text_bytes", "text_growth"] + OPS
+    with open(args.output, "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=fields)
+        writer.writeheader()
+        for row in rows:
+            writer.writerow(dict(row, time_s="%.6f" % row["time_s"], slowdown="%.3f" % row["slowdown"],
+                                 text_growth="%.4f" % row["text_growth"]))
+    print("results written to %s" % args.output)
+
+
+if __name__ == "__main__":
+    main()
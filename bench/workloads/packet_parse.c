@@ -0,0 +1,95 @@
+// Parses a buffer of length-prefixed packets (header, then TLV options, then payload) into
+// packet records, as a mote does with incoming radio messages: byte-level indexing with
+// offsets read from the data itself.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PACKETS 64
+#define HEADER_SIZE 6
+#define MAX_PAYLOAD 48
+
+struct packet {
+	int source;
+	int type;
+	int length;
+	unsigned char *payload;
+};
+
+int fill_packet(unsigned char *buf, int seed) {
+	int length = 8 + seed % (MAX_PAYLOAD - 8);
+	int options = seed % 3;
+	int i, pos;
+
+	buf[0] = seed & 0xFF;
+	buf[1] = (seed >> 8) & 0xFF;
+	buf[2] = seed % 5;
+	buf[3] = options;
+	buf[4] = length;
+	pos = HEADER_SIZE;
+	for (i = 0; i < options; i++) {
+		buf[pos] = i + 1;
+		buf[pos + 1] = 2;
+		buf[pos + 2] = seed + i;
+		buf[pos + 3] = seed - i;
+		pos += 4;
+	}
+	for (i = 0; i < length; i++)
+		buf[pos + i] = (seed * 31 + i) & 0xFF;
+	buf[5] = pos - HEADER_SIZE;
+	return pos + length;
+}
+
+int checksum(unsigned char *data, int length) {
+	int i;
+	int sum = 0;
+
+	for (i = 0; i < length; i++)
+		sum = (sum * 7 + data[i]) & 0xFFFF;
+	return sum;
+}
+
+int skip_options(unsigned char *buf, int pos, int count) {
+	int i;
+
+	for (i = 0; i < count; i++)
+		pos += 2 + buf[pos + 1];
+	return pos;
+}
+
+int parse_packet(unsigned char *buf, int pos, struct packet *p) {
+	int start;
+
+	p->source = buf[pos] | (buf[pos + 1] << 8);
+	p->type = buf[pos + 2];
+	p->length = buf[pos + 4];
+	start = skip_options(buf, pos + HEADER_SIZE, buf[pos + 3]);
+	memcpy(p->payload, buf + start, p->length);
+	return start + p->length;
+}
+
+int main(int argc, char **argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+	unsigned char *buf = malloc(PACKETS * (HEADER_SIZE + 12 + MAX_PAYLOAD));
+	struct packet *packets = malloc(PACKETS * sizeof(struct packet));
+	int it, i, pos, total;
+	long acc = 0;
+
+	for (i = 0; i < PACKETS; i++)
+		packets[i].payload = malloc(MAX_PAYLOAD);
+
+	total = 0;
+	for (i = 0; i < PACKETS; i++)
+		total += fill_packet(buf + total, i * 37 + 11);
+
+	for (it = 0; it < iterations; it++) {
+		pos = 0;
+		for (i = 0; i < PACKETS; i++)
+			pos = parse_packet(buf, pos, &packets[i]);
+		for (i = 0; i < PACKETS; i++)
+			acc += packets[i].source + packets[i].type + checksum(packets[i].payload, packets[i].length);
+	}
+
+	printf("acc is %ld\n", acc);
+	return 0;
+}
@@ -0,0 +1,75 @@
+// Traversal of a heap array of pointers to rows (as in test/test_adv.c), with rows that are
+// periodically grown with realloc and replaced, so that metadata table entries are moved and removed.
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ROWS 64
+#define MIN_COLUMNS 16
+#define MAX_COLUMNS 64
+
+int sum_row(int *row, int columns) {
+	int i;
+	int acc = 0;
+
+	for (i = 0; i < columns; i++)
+		acc += row[i];
+	return acc;
+}
+
+int sum_rows(int **rows, int *columns) {
+	int i;
+	int acc = 0;
+
+	for (i = 0; i < ROWS; i++)
+		acc += sum_row(*(rows + i), columns[i]);
+	return acc;
+}
+
+int sum_diagonal(int **rows, int *columns) {
+	int i;
+	int acc = 0;
+
+	for (i = 0; i < ROWS; i++)
+		acc += rows[i][i % columns[i]];
+	return acc;
+}
+
+void fill_row(int *row, int columns, int seed) {
+	int i;
+
+	for (i = 0; i < columns; i++)
+		row[i] = seed + i;
+}
+
+int main(int argc, char **argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+	int **rows = malloc(ROWS * sizeof(int *));
+	int *columns = malloc(ROWS * sizeof(int));
+	int it, i;
+	long acc = 0;
+
+	for (i = 0; i < ROWS; i++) {
+		columns[i] = MIN_COLUMNS;
+		rows[i] = malloc(columns[i] * sizeof(int));
+		fill_row(rows[i], columns[i], i);
+	}
+
+	for (it = 0; it < iterations; it++) {
+		acc += sum_rows(rows, columns);
+		acc += sum_diagonal(rows, columns);
+
+		i = it % ROWS;
+		if (columns[i] < MAX_COLUMNS) {
+			columns[i] *= 2;
+			rows[i] = realloc(rows[i], columns[i] * sizeof(int));
+		} else {
+			free(rows[i]);
+			columns[i] = MIN_COLUMNS;
+			rows[i] = malloc(columns[i] * sizeof(int));
+		}
+		fill_row(rows[i], columns[i], it);
+	}
+
+	printf("acc is %ld\n", acc);
+	return 0;
+}
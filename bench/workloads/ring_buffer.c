@@ -0,0 +1,94 @@
+// Producer/consumer message queues: ring buffers of integers and of pointers to messages, with
+// the storage reached through pointers kept in structs (metadata table updates and lookups).
+#include <stdio.h>
+#include <stdlib.h>
+
+#define QUEUES 8
+#define CAPACITY 32
+#define MESSAGE_SIZE 8
+
+struct ring {
+	int *data;
+	int **messages;
+	int head;
+	int tail;
+	int count;
+};
+
+void ring_init(struct ring *r) {
+	int i;
+
+	r->data = malloc(CAPACITY * sizeof(int));
+	r->messages = malloc(CAPACITY * sizeof(int *));
+	for (i = 0; i < CAPACITY; i++)
+		r->messages[i] = malloc(MESSAGE_SIZE * sizeof(int));
+	r->head = 0;
+	r->tail = 0;
+	r->count = 0;
+}
+
+int ring_push(struct ring *r, int value) {
+	int *message;
+	int i;
+
+	if (r->count == CAPACITY) return 0;
+	r->data[r->tail] = value;
+	message = r->messages[r->tail];
+	for (i = 0; i < MESSAGE_SIZE; i++)
+		message[i] = value + i;
+	r->tail = (r->tail + 1) % CAPACITY;
+	r->count++;
+	return 1;
+}
+
+int ring_pop(struct ring *r, int *value) {
+	int *message;
+	int i, sum = 0;
+
+	if (r->count == 0) return 0;
+	message = r->messages[r->head];
+	for (i = 0; i < MESSAGE_SIZE; i++)
+		sum += message[i];
+	*value = r->data[r->head] + sum;
+	r->head = (r->head + 1) % CAPACITY;
+	r->count--;
+	return 1;
+}
+
+// swaps the message buffers of two rings, as when a message is forwarded without copying it
+void ring_forward(struct ring *from, struct ring *to) {
+	int *message;
+
+	if (from->count == 0 || to->count == CAPACITY) return;
+	message = from->messages[from->head];
+	from->messages[from->head] = to->messages[to->tail];
+	to->messages[to->tail] = message;
+	to->data[to->tail] = from->data[from->head];
+	from->head = (from->head + 1) % CAPACITY;
+	from->count--;
+	to->tail = (to->tail + 1) % CAPACITY;
+	to->count++;
+}
+
+int main(int argc, char **argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+	struct ring *rings = malloc(QUEUES * sizeof(struct ring));
+	int it, q, value;
+	long acc = 0;
+
+	for (q = 0; q < QUEUES; q++)
+		ring_init(&rings[q]);
+
+	for (it = 0; it < iterations; it++) {
+		for (q = 0; q < QUEUES; q++)
+			while (ring_push(&rings[q], it * QUEUES + q));
+		for (q = 0; q < QUEUES; q++)
+			ring_forward(&rings[q], &rings[(q + 1) % QUEUES]);
+		for (q = 0; q < QUEUES; q++)
+			while (ring_pop(&rings[q], &value))
+				acc += value;
+	}
+
+	printf("acc is %ld\n", acc);
+	return 0;
+}
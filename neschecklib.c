@@ -1,50 +1,328 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 extern unsigned int TOS_NODE_ID;
+// bounds checks executed, incremented by the checks left after the optimizations of the pass
+// (only with opt -nescheck-count-checks)
 unsigned long checksexecuted = 0;
 
 // #define IS_DEBUGGING 1
 
+// Build with -DNESCHECK_COUNT_OPS to count the metadata table operations (moved entries included) and
+// print them at exit, along with the executed checks when the pass counts them (-nescheck-count-checks).
+// Lookups and updates that the pass inlines (shadow memory, lookup cache hits) are not counted.
+#ifdef NESCHECK_COUNT_OPS
+#ifdef NESCHECK_MOTE
+#error "the operation counters print to stderr, they are meant for host builds"
+#endif
+unsigned long metadatatablelookups = 0, metadatatableupdates = 0, metadatatableremovals = 0, metadatatablemoves = 0;
+#define COUNT_OP(counter) ((counter)++)
+#else
+#define COUNT_OP(counter)
+#endif
+
+#ifdef NESCHECK_SHADOW_MEMORY
+#include <sys/mman.h>
+
+// Direct-mapped shadow memory: the size of the pointer stored in slot p lives at a fixed
+// shadow address computed from p (shift + offset), so a lookup is a single load.
+// NesCheckPass emits the same arithmetic inline with -nescheck-shadow-memory, keep the two in sync.
+// Pointer slots are 8-byte aligned and sizes are stored as 32-bit values, so the shadow
+// of a 47-bit address space takes half of it, reserved lazily (MAP_NORESERVE).
+#define NESCHECK_SHADOW_OFFSET 0x100000000000UL
+#define NESCHECK_SHADOW_SIZE   0x400000000000UL
+#define SHADOW_ENTRY(p) ((unsigned int*)(((((unsigned long)(p)) >> 3) << 2) + NESCHECK_SHADOW_OFFSET))
+
+// MAP_FIXED would silently replace whatever is already mapped in the shadow range (a library, a large
+// heap block), so the address is only a hint: MAP_FIXED_NOREPLACE fails if the range is taken, and
+// kernels older than 4.17 (or without the flag) may place the mapping elsewhere, which is checked below
+#ifdef MAP_FIXED_NOREPLACE
+#define SHADOW_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE)
+#else
+#define SHADOW_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE)
+#endif
+
+__attribute__((constructor)) void initShadowMemory() {
+    void* shadow = mmap((void*)NESCHECK_SHADOW_OFFSET, NESCHECK_SHADOW_SIZE, PROT_READ | PROT_WRITE,
+                        SHADOW_MAP_FLAGS, -1, 0);
+    if (shadow != MAP_FAILED && shadow != (void*)NESCHECK_SHADOW_OFFSET) {
+        munmap(shadow, NESCHECK_SHADOW_SIZE);
+        shadow = MAP_FAILED;
+    }
+    if (shadow == MAP_FAILED) {
+        printf("Unable to reserve nesCheck shadow memory at %p, the range is (partly) in use.\n", (void*)NESCHECK_SHADOW_OFFSET);
+        fflush(stdout);
+        abort();
+    }
+}
+
+void setMetadataTableEntry(long p, long size, long addr) {
+    (void)addr; // the site of the update, only printed when debugging
+    COUNT_OP(metadatatableupdates);
+#ifdef IS_DEBUGGING
+    printf("[%p] Setting shadow entry for %p, size = %ld\n", (void*)addr, (void*)p, size);
+#endif
+    *SHADOW_ENTRY(p) = size;
+}
+long lookupMetadataTableEntry(long p) {
+    COUNT_OP(metadatatablelookups);
+    return *SHADOW_ENTRY(p);
+}
+
+// clears the shadow entries of the pointer slots in [p, p + size)
+void removeMetadataTableRange(long p, long size) {
+    unsigned long first = ((unsigned long)p + 7) >> 3, last = ((unsigned long)p + size) >> 3;
+    COUNT_OP(metadatatableremovals);
+    if (size <= 0 || last <= first) return;
+    memset(SHADOW_ENTRY(first << 3), 0, (last - first) * sizeof(unsigned int));
+}
+void moveMetadataTableRange(long oldp, long oldsize, long newp, long newsize) {
+    if (oldp == 0 || newp == 0) return; // realloc(NULL, ...) or realloc failed, the old block is untouched
+    COUNT_OP(metadatatablemoves);
+    if (newsize < oldsize) {
+        removeMetadataTableRange(oldp + newsize, oldsize - newsize);
+        oldsize = newsize;
+    }
+    if (newp == oldp || oldsize <= 0) return;
+    // blocks returned by realloc are equally aligned, so the slots line up one to one
+    memcpy(SHADOW_ENTRY(newp), SHADOW_ENTRY(oldp), (oldsize >> 3) * sizeof(unsigned int));
+    removeMetadataTableRange(oldp, oldsize);
+}
+
+#else
+
+// Open-addressing hash table (linear probing) keyed on the address of the pointer slot.
+// The capacity is always a power of two.
+#ifdef NESCHECK_MOTE
+#include <stdint.h>
+
+// Mote build: a static, malloc-free pool sized at compile time, with compact entries holding
+// 16-bit sizes and RAM-relative slot offsets. Size the pool with the header generated by
+// `opt -nescheck -nescheck-pool-size-header=<file>` (-DNESCHECK_POOL_HEADER='"<file>"').
+#ifdef NESCHECK_POOL_HEADER
+#include NESCHECK_POOL_HEADER
+#endif
+#ifndef NESCHECK_METADATA_POOL_SIZE
+#define NESCHECK_METADATA_POOL_SIZE 64
+#endif
+#ifndef NESCHECK_RAM_BASE
+#define NESCHECK_RAM_BASE 0
+#endif
+typedef char metadata_pool_size_must_be_a_power_of_two[(NESCHECK_METADATA_POOL_SIZE & (NESCHECK_METADATA_POOL_SIZE - 1)) == 0 ? 1 : -1];
+
+typedef uint16_t metadata_key_t;
+typedef uint16_t metadata_size_t;
+#define METADATA_KEY(p)     ((metadata_key_t)((p) - NESCHECK_RAM_BASE))
+#define METADATA_SLOT(k)    ((long)(k) + NESCHECK_RAM_BASE)
+#define METADATA_EMPTY_KEY  ((metadata_key_t)0xFFFF) // pointer slots are never at odd offsets
+#define METADATA_MAX_SIZE   0xFFFF
+#define METADATA_SLOT_SHIFT 1
+
+#else
+
+typedef long metadata_key_t;
+typedef long metadata_size_t;
+#define METADATA_KEY(p)     (p)
+#define METADATA_SLOT(k)    (k)
+#define METADATA_EMPTY_KEY  0 // NULL is never a valid pointer slot
+#define METADATA_SLOT_SHIFT 3
+#define METADATA_TABLE_INITIAL_CAPACITY 64
+
+#endif
+
 struct metadata_table_entry {
-    long ptr;
-    long size;
+    metadata_key_t ptr;
+    metadata_size_t size;
 };
 
 long metadatatablecount = 0;
-struct metadata_table_entry** metadatatable = NULL;
+// bumped on every change to the table: the per-site lookup caches injected by the pass
+// (-nescheck-lookup-cache) hold a (slot, size) pair only as long as the epoch they read is current
+// (and, with per-node tables, as long as metadatatablenode is TOS_NODE_ID)
+unsigned long metadatatableepoch = 0;
+#ifdef NESCHECK_MOTE
+#define metadatatablecapacity NESCHECK_METADATA_POOL_SIZE
+struct metadata_table_entry metadatatable[NESCHECK_METADATA_POOL_SIZE];
+int metadatatableinitialized = 0;
+#else
+long metadatatablecapacity = 0;
+struct metadata_table_entry* metadatatable = NULL;
+#endif
 
-// TODO: replace with the other BST efficient implementation.
-struct metadata_table_entry* findMetadataTableEntry(long p) {
-    struct metadata_table_entry* entry = NULL;
-    int i;
-    
-    for (i = 0; i < metadatatablecount; i++) {
-        if (metadatatable[i]->ptr == p) {
-            entry = metadatatable[i];
-            break;
+unsigned long hashMetadataTableKey(metadata_key_t k) {
+    // pointer slots are word-aligned, so the low bits carry no information
+    unsigned long h = ((unsigned long)k) >> METADATA_SLOT_SHIFT;
+    h ^= h >> 16;
+    h *= 0x45d9f3bUL;
+    h ^= h >> 16;
+    return h;
+}
+
+// returns the entry for k if present, or the empty entry where k would be inserted
+struct metadata_table_entry* findMetadataTableSlot(metadata_key_t k) {
+    unsigned long mask = metadatatablecapacity - 1;
+    unsigned long i = hashMetadataTableKey(k) & mask;
+
+    while (metadatatable[i].ptr != METADATA_EMPTY_KEY && metadatatable[i].ptr != k)
+        i = (i + 1) & mask;
+    return &metadatatable[i];
+}
+
+// removes the entry at index i, shifting back the following entries of its probe sequence
+// (backward-shift deletion), so that no tombstones are needed and the table only holds live slots
+void removeMetadataTableSlot(unsigned long i) {
+    unsigned long mask = metadatatablecapacity - 1;
+    unsigned long j = i, home;
+
+    while (1) {
+        j = (j + 1) & mask;
+        if (metadatatable[j].ptr == METADATA_EMPTY_KEY) break;
+        home = hashMetadataTableKey(metadatatable[j].ptr) & mask;
+        // the entry at j can fill the hole at i only if i lies cyclically between its home and j
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            metadatatable[i] = metadatatable[j];
+            i = j;
         }
     }
-    return entry;
+    metadatatable[i].ptr = METADATA_EMPTY_KEY;
+    metadatatablecount--;
+    metadatatableepoch++;
+}
+
+#ifdef NESCHECK_MOTE
+// Dropping an update would lose the size of the pointer, and a later check of it would fail for no
+// reason, so a full pool stops the program. The pass only sizes the pool with an upper bound when all
+// the pointer slots in the table are globals, and with an estimate otherwise (see the generated header).
+__attribute__((cold, noinline, noreturn))
+void reportMetadataTableOverflow(long p) {
+    printf("nesCheck metadata pool full (%d entries) at slot %p.\n", NESCHECK_METADATA_POOL_SIZE, (void*)p);
+    fflush(stdout);
+    __builtin_trap();
+}
+
+void initMetadataTable() {
+    int i;
+    for (i = 0; i < NESCHECK_METADATA_POOL_SIZE; i++)
+        metadatatable[i].ptr = METADATA_EMPTY_KEY;
+    metadatatableinitialized = 1;
+}
+#else
+void resizeMetadataTable(long newcapacity) {
+    struct metadata_table_entry* oldtable = metadatatable;
+    long oldcapacity = metadatatablecapacity;
+    long i;
+
+    metadatatablecapacity = newcapacity;
+    metadatatable = calloc(metadatatablecapacity, sizeof(struct metadata_table_entry));
+    for (i = 0; i < oldcapacity; i++) {
+        if (oldtable[i].ptr != METADATA_EMPTY_KEY)
+            *findMetadataTableSlot(oldtable[i].ptr) = oldtable[i];
+    }
+    free(oldtable);
+}
+#endif
+
+#ifdef NESCHECK_PER_NODE_TABLES
+#ifdef NESCHECK_MOTE
+#error "per-node metadata tables are meant for TOSSIM builds, not for motes"
+#endif
+// TOSSIM build: each simulated node gets its own table, so that lookups only probe the entries of
+// the current node. The table of the running node lives in the metadatatable* globals; when
+// TOS_NODE_ID changes, they are swapped with the saved table of the new node in O(1).
+struct metadata_table {
+    struct metadata_table_entry* entries;
+    long count;
+    long capacity;
+};
+
+struct metadata_table* nodemetadatatables = NULL;
+unsigned long nodemetadatatablescount = 0;
+unsigned long metadatatablenode = 0;
+
+void switchMetadataTableNode(unsigned long node) {
+    struct metadata_table* saved;
+
+    if (node >= nodemetadatatablescount) {
+        unsigned long newcount = nodemetadatatablescount ? nodemetadatatablescount : 16;
+        while (newcount <= node) newcount *= 2;
+        nodemetadatatables = realloc(nodemetadatatables, newcount * sizeof(struct metadata_table));
+        memset(nodemetadatatables + nodemetadatatablescount, 0,
+               (newcount - nodemetadatatablescount) * sizeof(struct metadata_table));
+        nodemetadatatablescount = newcount;
+    }
+
+    saved = &nodemetadatatables[metadatatablenode];
+    saved->entries = metadatatable;
+    saved->count = metadatatablecount;
+    saved->capacity = metadatatablecapacity;
+
+    saved = &nodemetadatatables[node];
+    metadatatable = saved->entries;
+    metadatatablecount = saved->count;
+    metadatatablecapacity = saved->capacity;
+    metadatatablenode = node;
+    // slots on the shared simulator stack can have the same address on different nodes
+    metadatatableepoch++;
+}
+#define SELECT_METADATA_TABLE() \
+    do { if (TOS_NODE_ID != metadatatablenode) switchMetadataTableNode(TOS_NODE_ID); } while (0)
+#else
+#define SELECT_METADATA_TABLE()
+#endif
+
+struct metadata_table_entry* findMetadataTableEntry(long p) {
+    struct metadata_table_entry* entry;
+
+    if (metadatatablecount == 0) return NULL;
+    entry = findMetadataTableSlot(METADATA_KEY(p));
+    return entry->ptr == METADATA_KEY(p) ? entry : NULL;
 }
 void setMetadataTableEntry(long p, long size, long addr) {
-    struct metadata_table_entry* entry = findMetadataTableEntry(p);
-    if (entry == NULL) { // not found, create it
+    struct metadata_table_entry* entry;
+
+    (void)addr; // the site of the update, only printed when debugging
+    COUNT_OP(metadatatableupdates);
+    SELECT_METADATA_TABLE();
+
+    // keep the load factor below 3/4
+    if ((metadatatablecount + 1) * 4 > metadatatablecapacity * 3) {
+#ifdef NESCHECK_MOTE
+        // the static pool is full: only existing entries can still be updated
+        if (findMetadataTableEntry(p) == NULL)
+            reportMetadataTableOverflow(p);
+#else
+        resizeMetadataTable(metadatatablecapacity ? metadatatablecapacity * 2 : METADATA_TABLE_INITIAL_CAPACITY);
+#endif
+    }
+#ifdef NESCHECK_MOTE
+    if (!metadatatableinitialized)
+        initMetadataTable();
+    if (size > METADATA_MAX_SIZE)
+        size = METADATA_MAX_SIZE;
+#endif
+
+    entry = findMetadataTableSlot(METADATA_KEY(p));
+    if (entry->ptr == METADATA_EMPTY_KEY) { // not found, create it
 #ifdef IS_DEBUGGING
         printf("[%p] Creating entry for %p, size = %ld\n", (void*)addr, (void*)p, size);
 #endif
-        entry = malloc(sizeof(struct metadata_table_entry));
-        entry->ptr = p;
-        entry->size = size;
+        entry->ptr = METADATA_KEY(p);
+        entry->size = 0;
         metadatatablecount++;
-        metadatatable = realloc(metadatatable, metadatatablecount * sizeof(struct metadata_table_entry *));
-        metadatatable[metadatatablecount - 1] = entry;
     }
 
-    entry->size = size;
+    if (entry->size != (metadata_size_t)size) {
+        entry->size = size;
+        metadatatableepoch++;
+    }
 }
 long lookupMetadataTableEntry(long p) {
-    struct metadata_table_entry* entry = findMetadataTableEntry(p);
+    struct metadata_table_entry* entry;
+
+    COUNT_OP(metadatatablelookups);
+    SELECT_METADATA_TABLE();
+    entry = findMetadataTableEntry(p);
     if (entry == NULL) {
 #ifdef IS_DEBUGGING
         printf("\tNot found %p\n", (void*)p);  
@@ -52,14 +330,142 @@ long lookupMetadataTableEntry(long p) {
         return 0;
     } else {
 #ifdef IS_DEBUGGING
-        printf("\tFound %p, size = %ld\n", (void*)p, entry->size);  
+        printf("\tFound %p, size = %ld\n", (void*)p, (long)entry->size);  
 #endif
         return entry->size;
     }
 }
 
-void printErrorLine(long l) {
-    printf("Memory error near line %ld.\n", l);
+// calls f on every entry for a pointer slot in [p, p + size). Depending on the size of the range,
+// either probes each slot address or scans the whole table; f may remove the entry it is given.
+void forEachMetadataTableEntryInRange(long p, long size, void (*f)(unsigned long, long), long arg) {
+    long slotsize = 1L << METADATA_SLOT_SHIFT;
+    struct metadata_table_entry* entry;
+    unsigned long i;
+    long slot;
+
+    if (metadatatablecount == 0 || size <= 0) return;
+
+    if ((size >> METADATA_SLOT_SHIFT) <= metadatatablecount) {
+        for (slot = (p + slotsize - 1) & ~(slotsize - 1); slot < p + size; slot += slotsize) {
+            if ((entry = findMetadataTableEntry(slot)) != NULL)
+                f(entry - metadatatable, arg);
+        }
+    } else {
+        i = 0;
+        while (i < (unsigned long)metadatatablecapacity) {
+            metadata_key_t k = metadatatable[i].ptr;
+            slot = METADATA_SLOT(k);
+            if (k != METADATA_EMPTY_KEY && slot >= p && slot < p + size) {
+                f(i, arg);
+                // a removal shifts a later entry into i, so look at it again
+                if (metadatatable[i].ptr != k) continue;
+            }
+            i++;
+        }
+    }
+}
+
+void removeMetadataTableEntryAt(unsigned long i, long unused) {
+    (void)unused; // the argument of forEachMetadataTableEntryInRange, only moves need one
+#ifdef IS_DEBUGGING
+    printf("\tRemoving entry for %p\n", (void*)METADATA_SLOT(metadatatable[i].ptr));
+#endif
+    removeMetadataTableSlot(i);
+}
+void moveMetadataTableEntryAt(unsigned long i, long delta) {
+    long slot = METADATA_SLOT(metadatatable[i].ptr);
+    long size = metadatatable[i].size;
+
+    // the old and new blocks never overlap, so the moved entry is never visited again
+    removeMetadataTableSlot(i);
+    setMetadataTableEntry(slot + delta, size, 0);
+}
+
+// removes the entries for all the pointer slots in [p, p + size), e.g. when the block at p is freed
+void removeMetadataTableRange(long p, long size) {
+    COUNT_OP(metadatatableremovals);
+    SELECT_METADATA_TABLE();
+    forEachMetadataTableEntryInRange(p, size, removeMetadataTableEntryAt, 0);
+#ifndef NESCHECK_MOTE
+    // shrink the table when most of it is empty, so that its size follows the live pointer slots
+    if (metadatatablecapacity > METADATA_TABLE_INITIAL_CAPACITY && metadatatablecount * 8 < metadatatablecapacity) {
+        long newcapacity = METADATA_TABLE_INITIAL_CAPACITY;
+        while (newcapacity * 3 < (metadatatablecount + 1) * 8)
+            newcapacity *= 2;
+        resizeMetadataTable(newcapacity);
+    }
+#endif
+}
+// moves the entries of the block at oldp to the block at newp after realloc(oldp, newsize)
+void moveMetadataTableRange(long oldp, long oldsize, long newp, long newsize) {
+    if (oldp == 0 || newp == 0) return; // realloc(NULL, ...) or realloc failed, the old block is untouched
+    COUNT_OP(metadatatablemoves);
+    SELECT_METADATA_TABLE();
+    if (newsize < oldsize) {
+        removeMetadataTableRange(oldp + newsize, oldsize - newsize);
+        oldsize = newsize;
+    }
+    if (newp != oldp)
+        forEachMetadataTableEntryInRange(oldp, oldsize, moveMetadataTableEntryAt, newp - oldp);
+}
+
+#endif
+
+#ifndef NESCHECK_MOTE
+// Table describing each bounds check site, registered by the pass from a module constructor, and
+// their execution counters (only with opt -nescheck-count-checks, NULL otherwise). A site is counted
+// every time its access runs, even if the pass optimized its check away, so that the profile ranks the
+// accesses the same way for any set of optimizations. The counters are dumped at exit as CSV to the
+// file named by $NESCHECK_PROFILE (nescheck_profile.csv by default).
+struct check_site_info {
+    const char* function;
+    long line;
+    long ordinal; // index of the check among those considered in its function
+};
+
+unsigned long* checksitecounters = NULL;
+const struct check_site_info* checksites = NULL;
+long checksitescount = 0;
+
+void dumpCheckSiteCounters() {
+    const char* path = getenv("NESCHECK_PROFILE");
+    FILE* out;
+    long i;
+
+    out = fopen(path ? path : "nescheck_profile.csv", "w");
+    if (out == NULL) {
+        printf("Unable to write the nesCheck profile.\n");
+        return;
+    }
+    fprintf(out, "site,function,ordinal,line,count\n");
+    for (i = 0; i < checksitescount; i++) {
+        fprintf(out, "%ld,%s,%ld,%ld,%lu\n", i, checksites[i].function, checksites[i].ordinal,
+                checksites[i].line, checksitecounters[i]);
+    }
+    fclose(out);
+}
+void registerCheckSiteCounters(unsigned long* counters, const struct check_site_info* sites, long count) {
+    checksitecounters = counters;
+    checksites = sites;
+    checksitescount = count;
+    if (counters != NULL)
+        atexit(dumpCheckSiteCounters);
+}
+#endif
+
+// Shared cold path of all the failing bounds checks: the trap block of each function passes the
+// site ID of the check that failed (an index into the site table, when registered) and its line.
+__attribute__((cold, noinline, noreturn))
+void reportCheckFailure(long site, long line) {
+#ifndef NESCHECK_MOTE
+    if (site >= 0 && site < checksitescount)
+        printf("Memory error in %s near line %ld (check site %ld).\n", checksites[site].function, line, site);
+    else
+#endif
+    printf("Memory error near line %ld (check site %ld).\n", line, site);
+    fflush(stdout);
+    __builtin_trap();
 }
 void printCheck(/*long l, long r*/) {
 #ifdef IS_DEBUGGING
@@ -68,3 +474,14 @@ void printCheck(/*long l, long r*/) {
     printf("?");
 #endif
 }
+
+#ifdef NESCHECK_COUNT_OPS
+// one line on stderr, so that it does not mix with the output of the program (parsed by bench/run_workloads.py)
+void dumpOpCounters() {
+    fprintf(stderr, "nescheck-ops checks %lu lookups %lu updates %lu removals %lu moves %lu\n",
+            checksexecuted, metadatatablelookups, metadatatableupdates, metadatatableremovals, metadatatablemoves);
+}
+__attribute__((constructor)) void registerOpCounters() {
+    atexit(dumpOpCounters);
+}
+#endif
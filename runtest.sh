@@ -1,19 +1,34 @@
 #!/bin/bash
 
-TESTFILE=test
+# the program of test/ to run, e.g. TESTFILE=test_handler ./runtest.sh, and its arguments
+TESTFILE=${TESTFILE:-test}
+TESTARGS=${TESTARGS:-}
+# extra options for the nesCheck pass and for the runtime build, e.g.
+#   NESCHECK_OPTS="-nescheck-shadow-memory" RUNTIME_CFLAGS="-DNESCHECK_SHADOW_MEMORY" ./runtest.sh
+NESCHECK_OPTS=${NESCHECK_OPTS:-}
+RUNTIME_CFLAGS=${RUNTIME_CFLAGS:-}
+# pipeline around the pass (see README.md):
+#   o0  - instrument the -O0 bitcode as is (default)
+#   ssa - promote to SSA first (mem2reg, SROA), then clean up and fold the checks after instrumenting
+NESCHECK_PIPELINE=${NESCHECK_PIPELINE:-o0}
+case "$NESCHECK_PIPELINE" in
+    o0)  PRE_PASSES=""; POST_PASSES="" ;;
+    ssa) PRE_PASSES="-mem2reg -sroa"; POST_PASSES="-instcombine -simplifycfg -gvn -instcombine -simplifycfg" ;;
+    *)   echo "unknown NESCHECK_PIPELINE $NESCHECK_PIPELINE (o0, ssa)"; exit 1 ;;
+esac
 
 make || exit 1;
 
-clang -O0 -g -emit-llvm neschecklib.c -c -o neschecklib.bc
+clang -O0 -g $RUNTIME_CFLAGS -emit-llvm neschecklib.c -c -o neschecklib.bc
 
 cd test
 rm -f $TESTFILE.bc $TESTFILE.ll $TESTFILE.opt.bc $TESTFILE.opt.ll $TESTFILE.s $TESTFILE.native $TESTFILE.nescheckout
 clang -O0 -g -emit-llvm "$TESTFILE.c" -c -o "$TESTFILE.bc" || exit 1;
 llvm-dis < "$TESTFILE.bc" > "$TESTFILE.ll"
 llvm-link ../neschecklib.bc "$TESTFILE.bc" -o "$TESTFILE.linked.bc"
-opt -o "$TESTFILE.opt.bc" -load ../../../../Debug+Asserts/lib/LLVMNesCheck.so -nescheck -stats -time-passes < "$TESTFILE.linked.bc" > "$TESTFILE.nescheckout" 2>&1  || exit 1;
+opt -o "$TESTFILE.opt.bc" -load ../../../../Debug+Asserts/lib/LLVMNesCheck.so $PRE_PASSES -nescheck $POST_PASSES $NESCHECK_OPTS -stats -time-passes < "$TESTFILE.linked.bc" > "$TESTFILE.nescheckout" 2>&1  || exit 1;
 llvm-dis < "$TESTFILE.opt.bc" > "$TESTFILE.opt.ll"
 llc "$TESTFILE.opt.bc" -o "$TESTFILE.s"
 gcc "$TESTFILE.s" -o "$TESTFILE.native"
 chmod +x $TESTFILE.native
-./$TESTFILE.native
+./$TESTFILE.native $TESTARGS
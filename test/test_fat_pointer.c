@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// Fat pointers: with
+//   NESCHECK_OPTS=-nescheck-fat-pointers TESTFILE=test_fat_pointer ./runtest.sh
+// the static array of pointers buffers becomes an array of { pointer, size } pairs, and the size of
+// a pointer loaded from it comes from its pair instead of the metadata table ("Arrays of pointers
+// stored as fat pointers" in test_fat_pointer.nescheckout). Every access is in bounds, and it prints
+// "total 24". With TESTARGS=oob, total reads the first buffer as long as the second, with
+// "Memory error in total".
+
+static int *buffers[3];
+
+int total(int which, int n) {
+	int i;
+	int acc = 0;
+
+	for (i = 0; i < n; i++)
+		acc += buffers[which][i];
+
+	return acc;
+}
+
+int main(int argc, char **argv) {
+	int i, j;
+	int oob = argc > 1;
+
+	(void)argv;
+	for (i = 0; i < 3; i++) {
+		buffers[i] = malloc((i + 1) * 4 * sizeof(int));
+		for (j = 0; j < (i + 1) * 4; j++)
+			buffers[i][j] = 1;
+	}
+
+	printf("total %d\n", total(0, oob ? 8 : 4) + total(1, 8) + total(2, 12));
+
+	for (i = 0; i < 3; i++)
+		free(buffers[i]);
+	return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// A TinyOS-style receive handler, which only reads the header fields of the message it gets: the
+// message_t* parameter stays SAFE, so the handler must keep its original signature, without a
+// size argument. Check with
+//   TESTFILE=test_handler ./runtest.sh && grep "define .*@Receive_receive" test/test_handler.opt.ll
+// which must show a single parameter.
+
+#define TOSH_DATA_LENGTH 28
+
+typedef struct {
+	uint8_t length;
+	uint8_t type;
+	uint16_t source;
+	uint16_t dest;
+} message_header_t;
+
+typedef struct {
+	message_header_t header;
+	uint8_t data[TOSH_DATA_LENGTH];
+} message_t;
+
+static unsigned received = 0;
+
+message_t* Receive_receive(message_t* msg) {
+	if (msg->header.type == 6 && msg->header.dest == 1)
+		received += msg->header.length;
+	return msg;
+}
+
+int main(void) {
+	message_t msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.header.length = 4;
+	msg.header.type = 6;
+	msg.header.dest = 1;
+	Receive_receive(&msg);
+	Receive_receive(&msg);
+
+	printf("received %u bytes\n", received);
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// Loop check hoisting: the offsets of a[i] and a[i + 1] are affine in i and do not wrap, so with
+//   NESCHECK_PIPELINE=ssa NESCHECK_OPTS=-nescheck-hoist-loop-checks TESTFILE=test_hoist ./runtest.sh
+// their checks become one range check in the preheader of the loop ("Checks hoisted out of loops" in
+// test_hoist.nescheckout). Every access is in bounds, and it prints "sum 9801". With TESTARGS=oob the
+// loop runs one iteration too many, and the range check must trap before entering it, with
+// "Memory error in sum_pairs".
+
+int sum_pairs(int *a, int n) {
+	int i;
+	int acc = 0;
+
+	for (i = 0; i < n - 1; i++)
+		acc += a[i] + a[i + 1];
+
+	return acc;
+}
+
+int main(int argc, char **argv) {
+	int *a;
+	int i, n = 100;
+	int oob = argc > 1;
+
+	(void)argv;
+	a = malloc(n * sizeof(int));
+	for (i = 0; i < n; i++)
+		a[i] = i;
+
+	printf("sum %d\n", sum_pairs(a, oob ? n + 1 : n));
+
+	free(a);
+	return 0;
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// Sizes through PHI nodes: with
+//   NESCHECK_PIPELINE=ssa TESTFILE=test_phi_size ./runtest.sh
+// p in last_of is a PHI of two buffers of different sizes, then a PHI of itself incremented in the
+// loop, and its size has to follow the same PHIs. Every access is in bounds, and it prints
+// "last 115 3". With TESTARGS=oob, p walks 16 elements into the small buffer: only its own size
+// (not the size of the big one) catches it, with "Memory error in last_of".
+
+int last_of(int *small, int *big, int pick_big, int n) {
+	int *p;
+	int i;
+
+	if (pick_big)
+		p = big;
+	else
+		p = small;
+	for (i = 0; i < n - 1; i++)
+		p++;
+
+	return *p;
+}
+
+int main(int argc, char **argv) {
+	int *small, *big;
+	int i;
+	int oob = argc > 1;
+
+	(void)argv;
+	small = malloc(4 * sizeof(int));
+	big = malloc(16 * sizeof(int));
+	for (i = 0; i < 4; i++)
+		small[i] = i;
+	for (i = 0; i < 16; i++)
+		big[i] = 100 + i;
+
+	printf("last %d %d\n", last_of(small, big, 1, 16), last_of(small, big, 0, oob ? 16 : 4));
+
+	free(small);
+	free(big);
+	return 0;
+}